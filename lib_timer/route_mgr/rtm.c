@@ -3,11 +3,422 @@
 #include <string.h>
 #include <memory.h>
 #include <assert.h>
-#include "rt.h"
+#include <stddef.h>
+#include "rtm.h"
+
+static uint32_t
+rt_hash_fnv1a(uint32_t hash, const char *buf, size_t len)
+{
+    size_t i;
+
+    for(i = 0; i < len && buf[i]; i++)
+        hash = (hash ^ (uint8_t)buf[i]) * 16777619u;
+    return hash;
+}
+
+#define RT_HASH_FNV1A_INIT  2166136261u
+
+/*------------------------------- Bucketed aging ----------------------------*/
+
+static void
+rt_age_bucket_remove(rt_table_t *rt_table, rt_entry_t *rt_entry)
+{
+    if(rt_entry->age_bucket == RT_AGE_BUCKET_NONE)
+        return;
+
+    if(rt_entry->age_prev)
+        rt_entry->age_prev->age_next = rt_entry->age_next;
+    else
+        rt_table->age_buckets[rt_entry->age_bucket] = rt_entry->age_next;
+    if(rt_entry->age_next)
+        rt_entry->age_next->age_prev = rt_entry->age_prev;
+    else if(rt_entry->age_bucket == RT_AGE_BUCKET_DRAIN)
+        rt_table->age_drain_tail = rt_entry->age_prev;
+
+    rt_entry->age_prev = 0;
+    rt_entry->age_next = 0;
+    rt_entry->age_bucket = RT_AGE_BUCKET_NONE;
+}
+
+/* Put the entry into the bucket swept after lifetime_msec (rounded up to
+ * the next tick). Refresh is just a remove followed by an insert. */
+static void
+rt_age_bucket_insert(rt_table_t *rt_table, rt_entry_t *rt_entry,
+                     unsigned long lifetime_msec)
+{
+    unsigned long tick_msec = RT_AGE_TICK_INTERVAL * 1000;
+    unsigned long ticks;
+    int bucket;
+
+    rt_age_bucket_remove(rt_table, rt_entry);
+
+    /* Fits, lifetimes are at most RT_TABLE_MAX_LIFETIME_MSEC */
+    ticks = (lifetime_msec + tick_msec - 1) / tick_msec + 1;
+    assert(ticks <= RT_AGE_BUCKETS_COUNT - 1);
+
+    bucket = (rt_table->age_curr_bucket + ticks) % RT_AGE_BUCKETS_COUNT;
+
+    rt_entry->age_bucket = bucket;
+    rt_entry->age_prev = 0;
+    rt_entry->age_next = rt_table->age_buckets[bucket];
+    if(rt_entry->age_next)
+        rt_entry->age_next->age_prev = rt_entry;
+    rt_table->age_buckets[bucket] = rt_entry;
+}
+
+/* Queue one expired entry at the tail of the drain queue */
+static void
+rt_age_drain_append(rt_table_t *rt_table, rt_entry_t *rt_entry)
+{
+    rt_age_bucket_remove(rt_table, rt_entry);
+
+    rt_entry->age_bucket = RT_AGE_BUCKET_DRAIN;
+    rt_entry->age_next = 0;
+    rt_entry->age_prev = rt_table->age_drain_tail;
+    if(rt_table->age_drain_tail)
+        rt_table->age_drain_tail->age_next = rt_entry;
+    else
+        rt_table->age_buckets[RT_AGE_BUCKET_DRAIN] = rt_entry;
+    rt_table->age_drain_tail = rt_entry;
+}
+
+/* Move all entries of the bucket to the tail of the drain queue */
+static void
+rt_age_bucket_drain(rt_table_t *rt_table, uint32_t bucket)
+{
+    rt_entry_t *rt_entry = NULL;
+    rt_entry_t *tail = NULL;
+
+    rt_entry = rt_table->age_buckets[bucket];
+    if(!rt_entry)
+        return;
+    rt_table->age_buckets[bucket] = NULL;
+
+    for(tail = rt_entry; ; tail = tail->age_next){
+        tail->age_bucket = RT_AGE_BUCKET_DRAIN;
+        if(!tail->age_next)
+            break;
+    }
+
+    rt_entry->age_prev = rt_table->age_drain_tail;
+    if(rt_table->age_drain_tail)
+        rt_table->age_drain_tail->age_next = rt_entry;
+    else
+        rt_table->age_buckets[RT_AGE_BUCKET_DRAIN] = rt_entry;
+    rt_table->age_drain_tail = tail;
+}
+
+/* Free an unlinked entry, without the lock (see rt_table_lock()) */
+static void
+rt_entry_release(rt_entry_t *rt_entry)
+{
+    if(rt_entry->exp_timer){
+        delete_timer(rt_entry->exp_timer);
+        rt_entry->exp_timer = NULL;
+    }
+    free(rt_entry);
+}
+
+/* Deterministic per route jitter in [0, exp_jitter_msec], so that routes
+ * installed together do not all age out in the same instant. */
+static unsigned long
+rt_entry_lifetime_msec(rt_table_t *rt_table, rt_entry_t *rt_entry)
+{
+    unsigned long lifetime_msec = rt_entry->time_to_expire * 1000;
+    uint32_t hash;
+
+    if(!rt_table->exp_jitter_msec)
+        return lifetime_msec;
+
+    hash = rt_hash_fnv1a(RT_HASH_FNV1A_INIT, rt_entry->rt_entry_keys.dest,
+                         sizeof(rt_entry->rt_entry_keys.dest));
+    hash = (hash ^ (uint8_t)rt_entry->rt_entry_keys.mask) * 16777619u;
+
+    return lifetime_msec + hash % (rt_table->exp_jitter_msec + 1);
+}
+
+/* The aging callback kept the entry, start a new full lifetime as a
+ * refresh would. With the lock held. */
+static void
+rt_entry_reage_kept(rt_table_t *rt_table, rt_entry_t *rt_entry)
+{
+    if(rt_table->aging_mode == RT_AGING_BUCKETED){
+        if(rt_entry->age_bucket == RT_AGE_BUCKET_NONE) /* Not refreshed */
+            rt_age_bucket_insert(rt_table, rt_entry,
+                                 rt_entry_lifetime_msec(rt_table, rt_entry));
+    } else if(rt_entry->age_bucket == RT_AGE_BUCKET_NONE){
+        timer_update_intervals(rt_entry->exp_timer,
+                               rt_entry_lifetime_msec(rt_table, rt_entry), 0);
+    }
+}
+
+/* Periodic tick, advance to the oldest bucket and age out its entries.
+ * At most max_expiry_per_tick entries are deleted, the rest stay queued
+ * for the following ticks so that a mass expiry is spread over time. */
+static void
+rt_age_sweep_cbk(Timer_t *timer, void *arg)
+{
+    rt_table_t *rt_table = (rt_table_t *)arg;
+    rt_entry_t *rt_entry = NULL;
+    rt_entry_t *expired = NULL;
+    rt_entry_t **expired_tail = &expired;
+    uint32_t bucket;
+    uint32_t budget;
+    bool deleted;
+
+    rt_table_lock(rt_table);
+    bucket = (rt_table->age_curr_bucket + 1) % RT_AGE_BUCKETS_COUNT;
+    rt_table->age_curr_bucket = bucket;
+    rt_age_bucket_drain(rt_table, bucket);
+
+    budget = rt_table->max_expiry_per_tick;
+
+    while((rt_entry = rt_table->age_buckets[RT_AGE_BUCKET_DRAIN])){
+        if(rt_table->max_expiry_per_tick && !budget--)
+            break;
+
+        rt_age_bucket_remove(rt_table, rt_entry);
+        rt_entry->expiring = true;
+        rt_entry->expire_next = NULL;
+        *expired_tail = rt_entry;
+        expired_tail = &rt_entry->expire_next;
+    }
+    rt_table_unlock(rt_table);
+
+    /* Callbacks run without the lock, they are free to delete any entry,
+     * which deletes its route timer (see rt_table_lock()). An expiring
+     * entry deleted meanwhile is only unlinked, it is freed here. */
+    for(rt_entry = expired; rt_entry; rt_entry = expired){
+        expired = rt_entry->expire_next;
+
+        rt_table_lock(rt_table);
+        deleted = rt_entry->deleted;
+        rt_table_unlock(rt_table);
+
+        if(!deleted && rt_entry->delete_cbk)
+            rt_entry->delete_cbk(rt_entry->exp_timer, rt_entry);
+
+        rt_table_lock(rt_table);
+        rt_entry->expiring = false;
+        deleted = rt_entry->deleted;
+        if(!deleted)
+            rt_entry_reage_kept(rt_table, rt_entry);
+        rt_table_unlock(rt_table);
+
+        if(deleted)
+            rt_entry_release(rt_entry);
+    }
+}
+
+/* Expiry of a per entry timer. Without a rate limit the application callback
+ * runs right away, otherwise the entry waits in the drain queue for the
+ * sweep tick. */
+static void
+rt_entry_expiry_cbk(Timer_t *timer, void *arg)
+{
+    rt_entry_t *rt_entry = (rt_entry_t *)arg;
+    rt_table_t *rt_table = rt_entry->rt_table;
+
+    rt_table_lock(rt_table);
+    if(rt_entry->deleted){
+        /* Being deleted by another thread, waiting for this callback */
+        rt_table_unlock(rt_table);
+        return;
+    }
+
+    /* The one shot timer is not re-armed by timer_lib */
+    if(rt_table->max_expiry_per_tick){
+        rt_age_drain_append(rt_table, rt_entry);
+        rt_table_unlock(rt_table);
+        return;
+    }
+    rt_table_unlock(rt_table);
+
+    if(rt_entry->delete_cbk)
+        rt_entry->delete_cbk(timer, rt_entry);
+
+    if(timer_get_current_state(timer) == TIMER_DELETED)
+        return; /* The callback freed the entry */
+
+    rt_table_lock(rt_table);
+    if(!rt_entry->deleted)
+        rt_entry_reage_kept(rt_table, rt_entry);
+    rt_table_unlock(rt_table);
+}
+
+/*----------------------- Secondary indexes (oif, gateway) ------------------*/
+
+#define RT_INDEX_LINK(rt_entry, link_offset) \
+    ((rt_index_link_t *)((char *)(rt_entry) + (link_offset)))
+
+/* key_size is the size of the entry field the key comes from (oif, gw_ip),
+ * a key filling the whole field has no terminating '\0' */
+static rt_index_group_t **
+rt_index_slot(rt_index_group_t **index, const char *key, size_t key_size)
+{
+    uint32_t hash;
+
+    hash = rt_hash_fnv1a(RT_HASH_FNV1A_INIT, key, key_size);
+    return &index[hash % RT_INDEX_HASH_SIZE];
+}
+
+static rt_index_group_t *
+rt_index_look_up(rt_index_group_t **index, const char *key, size_t key_size)
+{
+    rt_index_group_t *group;
+
+    for(group = *rt_index_slot(index, key, key_size); group; group = group->next){
+        if(strncmp(group->key, key, key_size) == 0)
+            return group;
+    }
+    return NULL;
+}
+
+static bool
+rt_index_insert(rt_index_group_t **index, size_t link_offset,
+                rt_entry_t *rt_entry, const char *key, size_t key_size)
+{
+    rt_index_link_t *link = RT_INDEX_LINK(rt_entry, link_offset);
+    rt_index_group_t **slot;
+    rt_index_group_t *group;
+
+    if(!key[0])
+        return true; /* Nothing to index */
+
+    assert(key_size <= sizeof(group->key));
+    group = rt_index_look_up(index, key, key_size);
+    if(!group){
+        group = calloc(1, sizeof(rt_index_group_t));
+        if(!group)
+            return false;
+        strncpy(group->key, key, key_size);
+        group->key_size = key_size;
+        slot = rt_index_slot(index, group->key, key_size);
+        group->next = *slot;
+        *slot = group;
+    }
+
+    link->group = group;
+    link->prev = 0;
+    link->next = group->head;
+    if(link->next)
+        RT_INDEX_LINK(link->next, link_offset)->prev = rt_entry;
+    group->head = rt_entry;
+    return true;
+}
+
+static void
+rt_index_remove(rt_index_group_t **index, size_t link_offset,
+                rt_entry_t *rt_entry)
+{
+    rt_index_link_t *link = RT_INDEX_LINK(rt_entry, link_offset);
+    rt_index_group_t *group = link->group;
+    rt_index_group_t **slot;
+
+    if(!group)
+        return;
+
+    if(link->prev)
+        RT_INDEX_LINK(link->prev, link_offset)->next = link->next;
+    else
+        group->head = link->next;
+    if(link->next)
+        RT_INDEX_LINK(link->next, link_offset)->prev = link->prev;
+
+    link->group = NULL;
+    link->prev = 0;
+    link->next = 0;
+
+    if(group->head)
+        return;
+
+    /* Last entry gone, release the group */
+    for(slot = rt_index_slot(index, group->key, group->key_size); *slot; slot = &(*slot)->next){
+        if(*slot == group){
+            *slot = group->next;
+            break;
+        }
+    }
+    free(group);
+}
+
+/*--------------------------------- Routing table ---------------------------*/
 
 void rt_init_rt_table(rt_table_t *rt_table)
 {
+    pthread_mutexattr_t attr;
+
+    memset(rt_table, 0, sizeof(rt_table_t));
     rt_table->head = NULL;
+    rt_table->aging_mode = RT_AGING_PER_ENTRY_TIMER;
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&rt_table->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+/* Spread the aging deadline of each route by up to jitter_msec */
+void rt_set_exp_jitter(rt_table_t *rt_table, uint32_t jitter_msec)
+{
+    if(jitter_msec > RT_TABLE_MAX_EXP_JITTER * 1000)
+        jitter_msec = RT_TABLE_MAX_EXP_JITTER * 1000;
+    rt_table_lock(rt_table);
+    rt_table->exp_jitter_msec = jitter_msec;
+    rt_table_unlock(rt_table);
+}
+
+/* Cap the number of routes aged out per tick, 0 for no cap. With per entry
+ * timers this starts the sweep tick, to drain the expired entries. */
+bool rt_set_expiry_rate_limit(rt_table_t *rt_table, uint32_t max_per_tick)
+{
+    rt_table_lock(rt_table);
+    if(max_per_tick && !rt_table->age_timer){
+        rt_table->age_timer = initialize_timer(rt_age_sweep_cbk,
+                                          RT_AGE_TICK_INTERVAL * 1000,
+                                          RT_AGE_TICK_INTERVAL * 1000,
+                                          0,
+                                          rt_table,
+                                          false);
+        if(!rt_table->age_timer){
+            rt_table_unlock(rt_table);
+            return false;
+        }
+        start_timer(rt_table->age_timer);
+    }
+    rt_table->max_expiry_per_tick = max_per_tick;
+    rt_table_unlock(rt_table);
+    return true;
+}
+
+/* Switch the table to bucketed aging, routes then share one periodic
+ * timer instead of a posix timer each. Must be done on an empty table. */
+bool rt_enable_bucketed_aging(rt_table_t *rt_table)
+{
+    rt_table_lock(rt_table);
+    if(rt_table->head || rt_table->aging_mode == RT_AGING_BUCKETED){
+        rt_table_unlock(rt_table);
+        return false;
+    }
+
+    /* The tick may already run for a rate limit set before */
+    if(!rt_table->age_timer){
+        rt_table->age_timer = initialize_timer(rt_age_sweep_cbk,
+                                          RT_AGE_TICK_INTERVAL * 1000,
+                                          RT_AGE_TICK_INTERVAL * 1000,
+                                          0,
+                                          rt_table,
+                                          false);
+        if(!rt_table->age_timer){
+            rt_table_unlock(rt_table);
+            return false;
+        }
+        start_timer(rt_table->age_timer);
+    }
+
+    rt_table->aging_mode = RT_AGING_BUCKETED;
+    rt_table_unlock(rt_table);
+    return true;
 }
 
 bool
@@ -17,10 +428,30 @@ rt_add_new_rt_entry(rt_table_t *rt_table,
                     char *gw_ip,
                     char *oif,
                     void (*delete_cbk)(Timer_t*, void *))
+{
+    return rt_add_rt_entry_with_lifetime(rt_table, dest, mask, gw_ip, oif,
+                                         0, delete_cbk);
+}
+
+/* Same as rt_add_new_rt_entry(), but the entry ages out after lifetime_msec
+ * instead of its full (jittered) lifetime, 0 for the full lifetime. Used to
+ * resume aging of restored routes. Lifetimes above RT_TABLE_MAX_LIFETIME_MSEC
+ * are rejected, in both aging modes. */
+bool
+rt_add_rt_entry_with_lifetime(rt_table_t *rt_table,
+                              char *dest,
+                              char mask,
+                              char *gw_ip,
+                              char *oif,
+                              unsigned long lifetime_msec,
+                              void (*delete_cbk)(Timer_t*, void *))
 {
     rt_entry_t *head = NULL;
     rt_entry_t *rt_entry = NULL;
 
+    if(lifetime_msec > RT_TABLE_MAX_LIFETIME_MSEC)
+        return false;
+
     rt_entry = calloc(1, sizeof(rt_entry_t));
 
     if(!rt_entry)
@@ -35,13 +466,40 @@ rt_add_new_rt_entry(rt_table_t *rt_table,
         strncpy(rt_entry->oif, oif, sizeof(rt_entry->oif));
 
     rt_entry->time_to_expire = RT_TABLE_EXP_TIME;
+    rt_entry->delete_cbk = delete_cbk;
+    rt_entry->rt_table = rt_table;
+    rt_entry->age_bucket = RT_AGE_BUCKET_NONE;
+
+    rt_table_lock(rt_table);
+
+    if(!lifetime_msec)
+        lifetime_msec = rt_entry_lifetime_msec(rt_table, rt_entry);
 
-    rt_entry->exp_timer = initialize_timer(delete_cbk,
-                                      rt_entry->time_to_expire * 1000,
-                                      0,
-                                      0,
-                                      rt_entry,
-                                      false);
+    if(!rt_index_insert(rt_table->oif_index, offsetof(rt_entry_t, oif_link),
+                        rt_entry, rt_entry->oif, sizeof(rt_entry->oif)) ||
+       !rt_index_insert(rt_table->gw_index, offsetof(rt_entry_t, gw_link),
+                        rt_entry, rt_entry->gw_ip, sizeof(rt_entry->gw_ip))){
+        rt_index_remove(rt_table->oif_index, offsetof(rt_entry_t, oif_link), rt_entry);
+        rt_table_unlock(rt_table);
+        free(rt_entry);
+        return false;
+    }
+
+    if(rt_table->aging_mode == RT_AGING_PER_ENTRY_TIMER){
+        rt_entry->exp_timer = initialize_timer(rt_entry_expiry_cbk,
+                                          lifetime_msec,
+                                          0,
+                                          0,
+                                          rt_entry,
+                                          false);
+        if(!rt_entry->exp_timer){
+            rt_index_remove(rt_table->oif_index, offsetof(rt_entry_t, oif_link), rt_entry);
+            rt_index_remove(rt_table->gw_index, offsetof(rt_entry_t, gw_link), rt_entry);
+            rt_table_unlock(rt_table);
+            free(rt_entry);
+            return false;
+        }
+    }
 
     head = rt_table->head;
     rt_table->head = rt_entry;
@@ -50,39 +508,260 @@ rt_add_new_rt_entry(rt_table_t *rt_table,
     if(head)
         head->prev = rt_entry;
 
-    start_timer(rt_entry->exp_timer);
+    if(rt_table->aging_mode == RT_AGING_BUCKETED)
+        rt_age_bucket_insert(rt_table, rt_entry, lifetime_msec);
+    else
+        start_timer(rt_entry->exp_timer);
+    rt_table_unlock(rt_table);
     return true;
 }
 
-bool rt_delete_rt_entry(rt_table_t *rt_table, char *dest, char mask)
+rt_entry_t *rt_look_up_rt_entry(rt_table_t *rt_table, char *dest, char mask)
 {
     rt_entry_t *rt_entry = NULL;
 
-    assert(dest && mask);
-
+    rt_table_lock(rt_table);
     ITERTAE_RT_TABLE_BEGIN(rt_table, rt_entry)
     {
         if(strncmp(rt_entry->rt_entry_keys.dest,
             dest, sizeof(rt_entry->rt_entry_keys.dest)) == 0 &&
             rt_entry->rt_entry_keys.mask == mask){
+            rt_table_unlock(rt_table);
+            return rt_entry;
+        }
+    } ITERTAE_RT_TABLE_END(rt_table, rt_entry);
+    rt_table_unlock(rt_table);
 
-            rt_entry_remove(rt_table, rt_entry);
+    return NULL;
+}
 
-            printf("deleting rt entry %p [%s:%d]\n",
-            rt_entry, rt_entry->rt_entry_keys.dest,
-            rt_entry->rt_entry_keys.mask);
+/* Route re-learnt, restart its full lifetime. The (jittered) lifetime is
+ * computed again, restored routes were started with what they had left. */
+bool rt_refresh_rt_entry(rt_table_t *rt_table, char *dest, char mask)
+{
+    rt_entry_t *rt_entry = NULL;
 
-            free(rt_entry);
-            return true;
+    rt_table_lock(rt_table);
+    rt_entry = rt_look_up_rt_entry(rt_table, dest, mask);
+    if(!rt_entry){
+        rt_table_unlock(rt_table);
+        return false;
+    }
+
+    if(rt_table->aging_mode == RT_AGING_BUCKETED){
+        rt_age_bucket_insert(rt_table, rt_entry,
+                             rt_entry_lifetime_msec(rt_table, rt_entry));
+    } else {
+        rt_age_bucket_remove(rt_table, rt_entry); /* Expired, not drained yet */
+        timer_update_intervals(rt_entry->exp_timer,
+                               rt_entry_lifetime_msec(rt_table, rt_entry), 0);
+    }
+    rt_table_unlock(rt_table);
+    return true;
+}
+
+/* Take the entry out of the table and all its lists, with the lock held.
+ * Returns false if the sweep runs its callback, the sweep then frees it. */
+static bool
+rt_entry_unlink(rt_table_t *rt_table, rt_entry_t *rt_entry)
+{
+    rt_entry_remove(rt_table, rt_entry);
+    rt_age_bucket_remove(rt_table, rt_entry);
+    rt_index_remove(rt_table->oif_index, offsetof(rt_entry_t, oif_link), rt_entry);
+    rt_index_remove(rt_table->gw_index, offsetof(rt_entry_t, gw_link), rt_entry);
+    rt_entry->deleted = true;
+    return !rt_entry->expiring;
+}
+
+/* Delete the entry in O(1), e.g. from its own aging callback. Returns false
+ * if another thread is already deleting it. */
+bool rt_entry_free(rt_table_t *rt_table, rt_entry_t *rt_entry)
+{
+    bool release;
+
+    rt_table_lock(rt_table);
+    if(rt_entry->deleted){
+        rt_table_unlock(rt_table);
+        return false;
+    }
+    release = rt_entry_unlink(rt_table, rt_entry);
+    rt_table_unlock(rt_table);
+
+    if(release)
+        rt_entry_release(rt_entry);
+    return true;
+}
+
+bool rt_delete_rt_entry(rt_table_t *rt_table, char *dest, char mask)
+{
+    rt_entry_t *rt_entry = NULL;
+    bool release;
+
+    assert(dest && mask);
+
+    rt_table_lock(rt_table);
+    rt_entry = rt_look_up_rt_entry(rt_table, dest, mask);
+    if(!rt_entry){
+        rt_table_unlock(rt_table);
+        return false;
+    }
+    printf("deleting rt entry %p [%s:%d]\n",
+    rt_entry, rt_entry->rt_entry_keys.dest,
+    rt_entry->rt_entry_keys.mask);
+
+    release = rt_entry_unlink(rt_table, rt_entry);
+    rt_table_unlock(rt_table);
+
+    if(release)
+        rt_entry_release(rt_entry);
+    return true;
+}
+
+/* Delete every entry of the index group matching key. Only the affected
+ * entries are visited, not the whole table. Returns the deleted count. */
+static uint32_t
+rt_flush_by_index(rt_table_t *rt_table, rt_index_group_t **index,
+                  size_t link_offset, char *key, size_t key_size)
+{
+    rt_index_group_t *group;
+    rt_entry_t *rt_entry;
+    rt_entry_t *unlinked = NULL;
+    uint32_t count = 0;
+    bool last;
+
+    rt_table_lock(rt_table);
+    group = rt_index_look_up(index, key, key_size);
+    if(!group){
+        rt_table_unlock(rt_table);
+        return 0;
+    }
+
+    /* The group is freed along with its last entry */
+    do {
+        rt_entry = group->head;
+        last = !RT_INDEX_LINK(rt_entry, link_offset)->next;
+        if(rt_entry_unlink(rt_table, rt_entry)){
+            rt_entry->next = unlinked;
+            unlinked = rt_entry;
+        }
+        count++;
+    } while(!last);
+    rt_table_unlock(rt_table);
+
+    /* Outside the lock, one timer_delete() per route timer, no disarm */
+    for(; unlinked; unlinked = rt_entry){
+        rt_entry = unlinked->next;
+        rt_entry_release(unlinked);
+    }
+
+    return count;
+}
+
+/* Interface went down, remove all the routes going out of it */
+uint32_t rt_flush_by_oif(rt_table_t *rt_table, char *oif)
+{
+    return rt_flush_by_index(rt_table, rt_table->oif_index,
+                             offsetof(rt_entry_t, oif_link),
+                             oif, sizeof(((rt_entry_t *)0)->oif));
+}
+
+/* Gateway unreachable, remove all the routes through it */
+uint32_t rt_flush_by_gw(rt_table_t *rt_table, char *gw_ip)
+{
+    return rt_flush_by_index(rt_table, rt_table->gw_index,
+                             offsetof(rt_entry_t, gw_link),
+                             gw_ip, sizeof(((rt_entry_t *)0)->gw_ip));
+}
+
+/* Give every entry of the index group matching key lifetime_msec to live,
+ * 0 for its full lifetime. Returns the re-aged count, 0 if lifetime_msec is
+ * above RT_TABLE_MAX_LIFETIME_MSEC. */
+static uint32_t
+rt_reage_by_index(rt_table_t *rt_table, rt_index_group_t **index,
+                  size_t link_offset, char *key, size_t key_size,
+                  unsigned long lifetime_msec)
+{
+    rt_index_group_t *group;
+    rt_entry_t *rt_entry;
+    unsigned long entry_lifetime_msec;
+    uint32_t count = 0;
+
+    if(lifetime_msec > RT_TABLE_MAX_LIFETIME_MSEC)
+        return 0;
+
+    rt_table_lock(rt_table);
+    group = rt_index_look_up(index, key, key_size);
+    if(!group){
+        rt_table_unlock(rt_table);
+        return 0;
+    }
+
+    for(rt_entry = group->head; rt_entry;
+        rt_entry = RT_INDEX_LINK(rt_entry, link_offset)->next){
+        entry_lifetime_msec = lifetime_msec ? lifetime_msec :
+                              rt_entry_lifetime_msec(rt_table, rt_entry);
+
+        if(rt_table->aging_mode == RT_AGING_BUCKETED){
+            rt_age_bucket_insert(rt_table, rt_entry, entry_lifetime_msec);
+        } else {
+            rt_age_bucket_remove(rt_table, rt_entry); /* Expired, not drained yet */
+            timer_update_intervals(rt_entry->exp_timer, entry_lifetime_msec, 0);
         }
-    } ITERTAE_RT_TABLE_END(rt_table, curr);
+        count++;
+    }
+    rt_table_unlock(rt_table);
+
+    return count;
+}
+
+/* Interface flapped, restart (or shorten) the aging of its routes */
+uint32_t rt_reage_by_oif(rt_table_t *rt_table, char *oif,
+                         unsigned long lifetime_msec)
+{
+    return rt_reage_by_index(rt_table, rt_table->oif_index,
+                             offsetof(rt_entry_t, oif_link),
+                             oif, sizeof(((rt_entry_t *)0)->oif),
+                             lifetime_msec);
+}
+
+uint32_t rt_reage_by_gw(rt_table_t *rt_table, char *gw_ip,
+                        unsigned long lifetime_msec)
+{
+    return rt_reage_by_index(rt_table, rt_table->gw_index,
+                             offsetof(rt_entry_t, gw_link),
+                             gw_ip, sizeof(((rt_entry_t *)0)->gw_ip),
+                             lifetime_msec);
+}
 
-    return false;
+unsigned long
+rt_entry_get_remaining_time_in_msec(rt_table_t *rt_table, rt_entry_t *rt_entry)
+{
+    unsigned long remaining_msec = 0;
+    uint32_t ticks;
+
+    rt_table_lock(rt_table);
+    if(rt_entry->age_bucket == RT_AGE_BUCKET_DRAIN){
+        remaining_msec = 0; /* Expired, waiting in the drain queue */
+    } else if(rt_table->aging_mode == RT_AGING_PER_ENTRY_TIMER){
+        /* Fired, its callback is running */
+        if(is_timer_running(rt_entry->exp_timer))
+            remaining_msec = timer_get_remaining_time_in_msec(rt_entry->exp_timer);
+    } else if(rt_entry->age_bucket != RT_AGE_BUCKET_NONE){
+        /* Whole ticks still to go, plus what is left of the current one */
+        ticks = (rt_entry->age_bucket + RT_AGE_BUCKETS_COUNT -
+                 rt_table->age_curr_bucket) % RT_AGE_BUCKETS_COUNT;
+        remaining_msec = (ticks - 1) * RT_AGE_TICK_INTERVAL * 1000 +
+                         timer_get_remaining_time_in_msec(rt_table->age_timer);
+    }
+    rt_table_unlock(rt_table);
+    return remaining_msec;
 }
 
 void rt_dump_rt_table(rt_table_t *rt_table)
 {
     rt_entry_t *rt_entry = NULL;
+
+    rt_table_lock(rt_table);
     ITERTAE_RT_TABLE_BEGIN(rt_table, rt_entry)
     {
         printf("%-20s %-4d %-20s %-12s %usec (%lums)\n",
@@ -91,8 +770,9 @@ void rt_dump_rt_table(rt_table_t *rt_table)
             rt_entry->gw_ip,
             rt_entry->oif,
             rt_entry->time_to_expire,
-            timer_get_remaining_time_in_msec(rt_entry->exp_timer));
+            rt_entry_get_remaining_time_in_msec(rt_table, rt_entry));
     } ITERTAE_RT_TABLE_END(rt_tabl, rt_entry);
+    rt_table_unlock(rt_table);
 }
 
 bool rt_update_rt_entry(rt_table_t *rt_table, char *dest, char mask, char *new_gw_ip, char *new_oif)
@@ -103,12 +783,35 @@ bool rt_update_rt_entry(rt_table_t *rt_table, char *dest, char mask, char *new_g
 
 void rt_clear_rt_table(rt_table_t *rt_table)
 {
-    //TODO
-    return;
+    rt_entry_t *rt_entry = NULL;
+    rt_entry_t *unlinked = NULL;
+
+    rt_table_lock(rt_table);
+    ITERTAE_RT_TABLE_BEGIN(rt_table, rt_entry)
+    {
+        if(rt_entry_unlink(rt_table, rt_entry)){
+            rt_entry->next = unlinked;
+            unlinked = rt_entry;
+        }
+    } ITERTAE_RT_TABLE_END(rt_table, rt_entry);
+    rt_table_unlock(rt_table);
+
+    for(; unlinked; unlinked = rt_entry){
+        rt_entry = unlinked->next;
+        rt_entry_release(unlinked);
+    }
 }
 
+/* Not to be called concurrently with other rt_* calls on the table */
 void rt_free_rt_table(rt_table_t *rt_table)
 {
-    //TODO
-    return;
+    /* Waits for a running sweep, which needs the table lock */
+    if(rt_table->age_timer){
+        delete_timer(rt_table->age_timer);
+        rt_table->age_timer = NULL;
+    }
+
+    rt_clear_rt_table(rt_table);
+    rt_table->aging_mode = RT_AGING_PER_ENTRY_TIMER;
+    pthread_mutex_destroy(&rt_table->lock);
 }
@@ -3,43 +3,170 @@
 
 #include <stdint.h>
 #include <stdbool.h>
-#include "../timer_lib/timerlib.h"
+#include <pthread.h>
+#include "../timer_lib/timer_lib.h"
 
 #define RT_TABLE_EXP_TIME   30  /* 30 sec */
+#define RT_TABLE_MAX_EXP_JITTER 10  /* 10 sec, upper bound of rt_set_exp_jitter() */
+
+/* Longest lifetime a route can be given, larger ones are rejected */
+#define RT_TABLE_MAX_LIFETIME_MSEC  \
+    ((RT_TABLE_EXP_TIME + RT_TABLE_MAX_EXP_JITTER) * 1000)
+
+/* Bucketed aging: routes are grouped per RT_AGE_TICK_INTERVAL and one
+ * periodic timer sweeps the oldest group on every tick. One extra bucket
+ * rounds the lifetime up to a tick boundary, so entries never age out early.
+ * Swept entries wait in the drain queue until the per tick limit allows
+ * them to be deleted. With per entry timers and a rate limit, expired
+ * entries go through the same drain queue and tick. */
+#define RT_AGE_TICK_INTERVAL    1   /* 1 sec */
+#define RT_AGE_BUCKETS_COUNT    \
+    (RT_TABLE_MAX_LIFETIME_MSEC / 1000 / RT_AGE_TICK_INTERVAL + 2)
+#define RT_AGE_BUCKET_DRAIN     RT_AGE_BUCKETS_COUNT
+#define RT_AGE_BUCKET_NONE      (-1)
+
+/* Secondary indexes (by oif, by gateway) are hashed into this many slots */
+#define RT_INDEX_HASH_SIZE      256
+
+typedef enum RT_AGING_MODE_ {
+    RT_AGING_PER_ENTRY_TIMER = 0,   /* one posix timer per route entry */
+    RT_AGING_BUCKETED               /* one periodic timer for the whole table */
+} RT_AGING_MODE_T;
 
 typedef struct rt_entry_keys_{
     char dest[16];
     char mask;
 } rt_entry_keys_t;
 
+struct rt_entry_;
+struct rt_table_;
+
+/* All the route entries sharing one oif (or gateway) */
+typedef struct rt_index_group_{
+    char key[32];
+    size_t key_size;                /* Key field size, may leave no '\0' */
+    struct rt_entry_ *head;
+    struct rt_index_group_ *next;   /* Next group in the same hash slot */
+} rt_index_group_t;
+
+/* Intrusive link of a route entry into a secondary index group */
+typedef struct rt_index_link_{
+    rt_index_group_t *group;        /* NULL if the entry has no such key */
+    struct rt_entry_ *prev;
+    struct rt_entry_ *next;
+} rt_index_link_t;
+
 typedef struct rt_entry_{
     /* A Structure which represents only the keys of the Routing Table.*/
     rt_entry_keys_t rt_entry_keys;
     char gw_ip[16];
     char oif[32];
     uint32_t time_to_expire; /* time left to delete the entry */
+    bool deleted;            /* Unlinked, about to be freed */
     struct rt_entry_ *prev;
     struct rt_entry_ *next;
     Timer_t *exp_timer; /* Timer structure to expire the route entry */
+    void (*delete_cbk)(Timer_t *, void *); /* Invoked when the entry ages out */
+    struct rt_table_ *rt_table; /* Owning table, for the per entry timer */
+
+    /* Bucketed aging, links the entry into rt_table->age_buckets[age_bucket] */
+    int age_bucket;
+    struct rt_entry_ *age_prev;
+    struct rt_entry_ *age_next;
+
+    /* Aged out by the sweep, which runs its delete_cbk without the lock */
+    bool expiring;
+    struct rt_entry_ *expire_next;
+
+    /* Secondary indexes, for bulk operations per oif and per gateway */
+    rt_index_link_t oif_link;
+    rt_index_link_t gw_link;
 } rt_entry_t;
 
 /* Routing table DB */
 typedef struct rt_table_{
     rt_entry_t *head;
+    pthread_mutex_t lock;       /* Recursive, the sweep calls back into rt_* */
+
+    RT_AGING_MODE_T aging_mode;
+    rt_entry_t *age_buckets[RT_AGE_BUCKETS_COUNT + 1]; /* + drain queue */
+    rt_entry_t *age_drain_tail;
+    uint32_t age_curr_bucket;   /* Bucket swept on the last tick */
+    Timer_t *age_timer;         /* Periodic sweep timer, bucketed aging or
+                                   rate limited per entry aging */
+
+    uint32_t exp_jitter_msec;   /* Max per entry jitter added to the lifetime */
+    uint32_t max_expiry_per_tick; /* Deletions per sweep, 0 for unlimited */
+
+    rt_index_group_t *oif_index[RT_INDEX_HASH_SIZE];
+    rt_index_group_t *gw_index[RT_INDEX_HASH_SIZE];
 } rt_table_t;
 
 void rt_init_rt_table(rt_table_t *rt_table);
+bool rt_enable_bucketed_aging(rt_table_t *rt_table);
+void rt_set_exp_jitter(rt_table_t *rt_table, uint32_t jitter_msec);
+bool rt_set_expiry_rate_limit(rt_table_t *rt_table, uint32_t max_per_tick);
+
+/* timer_cb(timer, rt_entry) is invoked, without the table lock, when the
+ * route ages out. timer is the route's own timer, NULL with bucketed aging,
+ * and belongs to the table: it may be cancelled but never deleted. The
+ * callback frees the route with rt_entry_free(), a route it keeps (and
+ * does not refresh) starts a new full lifetime. */
 bool rt_add_new_rt_entry(rt_table_t *rt_table,
                         char *dest_ip, char mask, char *gw_ip, char *oif,
                         void (*timer_cb)(Timer_t*, void *));
+/* lifetime_msec: 0 for the full lifetime, at most RT_TABLE_MAX_LIFETIME_MSEC */
+bool rt_add_rt_entry_with_lifetime(rt_table_t *rt_table,
+                        char *dest_ip, char mask, char *gw_ip, char *oif,
+                        unsigned long lifetime_msec,
+                        void (*timer_cb)(Timer_t*, void *));
+/* The entry may be aged out and freed by the sweep as soon as the lock is
+ * dropped, hold rt_table_lock() for as long as it is used */
+rt_entry_t *rt_look_up_rt_entry(rt_table_t *rt_table,
+                        char *dest_ip, char mask);
+bool rt_refresh_rt_entry(rt_table_t *rt_table,
+                        char *dest_ip, char mask);
 bool rt_delete_rt_entry(rt_table_t *rt_table,
                         char *dest_ip, char mask);
+bool rt_entry_free(rt_table_t *rt_table, rt_entry_t *rt_entry);
+uint32_t rt_flush_by_oif(rt_table_t *rt_table, char *oif);
+uint32_t rt_flush_by_gw(rt_table_t *rt_table, char *gw_ip);
+/* lifetime_msec as for rt_add_rt_entry_with_lifetime(), returns 0 if too long */
+uint32_t rt_reage_by_oif(rt_table_t *rt_table, char *oif,
+                        unsigned long lifetime_msec);
+uint32_t rt_reage_by_gw(rt_table_t *rt_table, char *gw_ip,
+                        unsigned long lifetime_msec);
 bool rt_update_rt_entry(rt_table_t *rt_table,
                         char *dest_ip, char mask,
                         char *new_gw_ip, char *new_oif);
 void rt_clear_rt_table(rt_table_t *rt_table);
 void rt_free_rt_table(rt_table_t *rt_table);
 void rt_dump_rt_table(rt_table_t *rt_table);
+unsigned long rt_entry_get_remaining_time_in_msec(rt_table_t *rt_table,
+                        rt_entry_t *rt_entry);
+
+/* Warm restart, rtm_snapshot.c */
+bool rt_snapshot_rt_table(rt_table_t *rt_table, const char *file_name);
+long rt_restore_rt_table(rt_table_t *rt_table, const char *file_name,
+                        void (*timer_cb)(Timer_t*, void *));
+
+/*
+ * Locking: every public rt_* call takes rt_table->lock, so does the sweep.
+ * A route timer may be waiting for the lock from its expiry callback, so
+ * route timers are never deleted with the lock held, and aging callbacks
+ * (delete_cbk) are always invoked without it.
+ */
+static inline void
+rt_table_lock(rt_table_t *rt_table)
+{
+    pthread_mutex_lock(&rt_table->lock);
+}
+
+static inline void
+rt_table_unlock(rt_table_t *rt_table)
+{
+    pthread_mutex_unlock(&rt_table->lock);
+}
 
 static inline void 
 rt_entry_remove(rt_table_t *rt_table, rt_entry_t *rt_entry)
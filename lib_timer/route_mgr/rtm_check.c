@@ -0,0 +1,459 @@
+/***************************************************************************************************
+ * Non interactive check of the routing table aging, exits non zero on the first failure.
+ * Build: gcc -o rtm_check rtm_check.c rtm.c rtm_snapshot.c ../timer_lib/timer_lib.c -lrt -lpthread
+ ***************************************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "rtm.h"
+
+#define CHECK(cond)                                                         \
+    do {                                                                    \
+        if(!(cond)){                                                        \
+            printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond);          \
+            exit(1);                                                        \
+        }                                                                   \
+    } while(0)
+
+static rt_table_t rt;
+
+static void
+rt_entry_delete_on_timer_expiry(Timer_t *timer, void *user_data)
+{
+    rt_entry_free(&rt, (rt_entry_t *)user_data);
+}
+
+static uint32_t
+rt_count(rt_table_t *rt_table)
+{
+    rt_entry_t *rt_entry;
+    uint32_t count = 0;
+
+    rt_table_lock(rt_table);
+    for(rt_entry = rt_table->head; rt_entry; rt_entry = rt_entry->next)
+        count++;
+    rt_table_unlock(rt_table);
+    return count;
+}
+
+/* Remaining lifetime of a route, looked up under the lock */
+static unsigned long
+rt_remaining_msec(char *dest, char mask)
+{
+    rt_entry_t *rt_entry;
+    unsigned long remaining_msec;
+
+    rt_table_lock(&rt);
+    rt_entry = rt_look_up_rt_entry(&rt, dest, mask);
+    CHECK(rt_entry);
+    remaining_msec = rt_entry_get_remaining_time_in_msec(&rt, rt_entry);
+    rt_table_unlock(&rt);
+    return remaining_msec;
+}
+
+/* n routes 10.x.y.z/32, oif eth<i % 4>, gateway 1.1.1.<i % 8> */
+static void
+rt_add_routes(rt_table_t *rt_table, uint32_t n, unsigned long lifetime_msec)
+{
+    char dest[16], gw_ip[16], oif[32];
+    uint32_t i;
+
+    for(i = 0; i < n; i++){
+        snprintf(dest, sizeof(dest), "10.%u.%u.%u",
+                 (i >> 16) & 0xff, (i >> 8) & 0xff, i & 0xff);
+        snprintf(gw_ip, sizeof(gw_ip), "1.1.1.%u", i % 8);
+        snprintf(oif, sizeof(oif), "eth%u", i % 4);
+        CHECK(rt_add_rt_entry_with_lifetime(rt_table, dest, 32, gw_ip, oif,
+                                            lifetime_msec,
+                                            rt_entry_delete_on_timer_expiry));
+    }
+}
+
+/* Routes never age out before their lifetime and are gone a tick after */
+static void
+check_aging(RT_AGING_MODE_T mode)
+{
+    rt_init_rt_table(&rt);
+    if(mode == RT_AGING_BUCKETED)
+        CHECK(rt_enable_bucketed_aging(&rt));
+
+    rt_add_routes(&rt, 1000, 1500);
+    CHECK(rt_count(&rt) == 1000);
+    if(mode == RT_AGING_BUCKETED){
+        rt_table_lock(&rt);
+        CHECK(rt.head->exp_timer == NULL);
+        rt_table_unlock(&rt);
+    }
+
+    /* Refreshed routes get the full lifetime again */
+    CHECK(rt_refresh_rt_entry(&rt, "10.0.0.1", 32));
+    CHECK(rt_remaining_msec("10.0.0.1", 32) > 10000);
+
+    usleep(1000 * 1000);
+    CHECK(rt_count(&rt) == 1000);
+    usleep(2600 * 1000);
+    CHECK(rt_count(&rt) == 1);
+
+    CHECK(rt_delete_rt_entry(&rt, "10.0.0.1", 32));
+    CHECK(rt_count(&rt) == 0);
+    rt_free_rt_table(&rt);
+    printf("aging (%s): ok\n",
+           mode == RT_AGING_BUCKETED ? "bucketed" : "per entry");
+}
+
+static uint32_t kept_count;
+static bool kept_bad_timer;
+
+/* Keeps the route, checks it is passed its own timer */
+static void
+rt_entry_keep_on_timer_expiry(Timer_t *timer, void *user_data)
+{
+    rt_entry_t *rt_entry = (rt_entry_t *)user_data;
+
+    if(timer != rt_entry->exp_timer)
+        kept_bad_timer = true;
+    __atomic_add_fetch(&kept_count, 1, __ATOMIC_SEQ_CST);
+}
+
+/* Routes kept by their callback age again, with their full lifetime */
+static void
+check_kept(RT_AGING_MODE_T mode, uint32_t max_per_tick)
+{
+    char dest[16];
+    uint32_t i;
+
+    rt_init_rt_table(&rt);
+    if(mode == RT_AGING_BUCKETED)
+        CHECK(rt_enable_bucketed_aging(&rt));
+    if(max_per_tick)
+        CHECK(rt_set_expiry_rate_limit(&rt, max_per_tick));
+
+    kept_count = 0;
+    kept_bad_timer = false;
+    for(i = 0; i < 10; i++){
+        snprintf(dest, sizeof(dest), "10.0.0.%u", i);
+        CHECK(rt_add_rt_entry_with_lifetime(&rt, dest, 32, "1.1.1.1", "eth0",
+                                            500, rt_entry_keep_on_timer_expiry));
+    }
+
+    usleep(2500 * 1000);
+    CHECK(__atomic_load_n(&kept_count, __ATOMIC_SEQ_CST) == 10);
+    CHECK(!kept_bad_timer);
+    CHECK(rt_count(&rt) == 10);
+    for(i = 0; i < 10; i++){
+        snprintf(dest, sizeof(dest), "10.0.0.%u", i);
+        CHECK(rt_remaining_msec(dest, 32) > (RT_TABLE_EXP_TIME - 3) * 1000);
+    }
+
+    rt_free_rt_table(&rt);
+    printf("kept by callback (%s%s): ok\n",
+           mode == RT_AGING_BUCKETED ? "bucketed" : "per entry",
+           max_per_tick ? ", rate limited" : "");
+}
+
+/* Lifetimes are spread by the jitter, also after a refresh */
+static void
+check_jitter(RT_AGING_MODE_T mode)
+{
+    unsigned long remaining_msec, min_msec, max_msec;
+    rt_entry_t *rt_entry;
+    int pass;
+
+    rt_init_rt_table(&rt);
+    if(mode == RT_AGING_BUCKETED)
+        CHECK(rt_enable_bucketed_aging(&rt));
+    rt_set_exp_jitter(&rt, 5000);
+
+    rt_add_routes(&rt, 200, 0);
+    for(pass = 0; pass < 2; pass++){
+        min_msec = ~0UL;
+        max_msec = 0;
+        rt_table_lock(&rt);
+        for(rt_entry = rt.head; rt_entry; rt_entry = rt_entry->next){
+            remaining_msec = rt_entry_get_remaining_time_in_msec(&rt, rt_entry);
+            if(remaining_msec < min_msec)
+                min_msec = remaining_msec;
+            if(remaining_msec > max_msec)
+                max_msec = remaining_msec;
+            if(pass == 0)
+                CHECK(rt_refresh_rt_entry(&rt, rt_entry->rt_entry_keys.dest,
+                                          rt_entry->rt_entry_keys.mask));
+        }
+        rt_table_unlock(&rt);
+
+        /* Bucketed lifetimes are rounded up to the next tick */
+        CHECK(min_msec >= (RT_TABLE_EXP_TIME - 1) * 1000);
+        CHECK(max_msec <= (RT_TABLE_EXP_TIME + 5 + 2 * RT_AGE_TICK_INTERVAL) * 1000);
+        CHECK(max_msec - min_msec >= 3000);
+    }
+
+    rt_free_rt_table(&rt);
+    printf("jitter (%s): ok\n",
+           mode == RT_AGING_BUCKETED ? "bucketed" : "per entry");
+}
+
+/* Expired routes are deleted at most max_per_tick per tick */
+static void
+check_rate_limit(RT_AGING_MODE_T mode)
+{
+    uint32_t count;
+
+    rt_init_rt_table(&rt);
+    if(mode == RT_AGING_BUCKETED)
+        CHECK(rt_enable_bucketed_aging(&rt));
+    CHECK(rt_set_expiry_rate_limit(&rt, 10));
+
+    rt_add_routes(&rt, 30, 500);
+    usleep(2500 * 1000);
+    count = rt_count(&rt);
+    CHECK(count > 0 && count < 30);
+    usleep(3500 * 1000);
+    CHECK(rt_count(&rt) == 0);
+
+    rt_free_rt_table(&rt);
+    printf("rate limit (%s): ok\n",
+           mode == RT_AGING_BUCKETED ? "bucketed" : "per entry");
+}
+
+/* Flushes both routes of the pair, the partner may be expiring as well */
+static void
+rt_pair_flush_on_timer_expiry(Timer_t *timer, void *user_data)
+{
+    char gw_ip[16];
+
+    memcpy(gw_ip, ((rt_entry_t *)user_data)->gw_ip, sizeof(gw_ip));
+    usleep(2 * 1000); /* Widens the window for the partner timer to fire */
+    rt_flush_by_gw(&rt, gw_ip);
+}
+
+/* Aging callbacks delete other routes whose timers are firing meanwhile:
+ * the first routes of the pairs are drained on the first tick, when their
+ * partners expire. A deadlock fails the check by SIGALRM. */
+static void
+check_delete_from_callback(RT_AGING_MODE_T mode)
+{
+    char dest[16], gw_ip[16];
+    uint32_t i;
+
+    rt_init_rt_table(&rt);
+    if(mode == RT_AGING_BUCKETED)
+        CHECK(rt_enable_bucketed_aging(&rt));
+    CHECK(rt_set_expiry_rate_limit(&rt, 20));
+
+    for(i = 0; i < 200; i++){
+        snprintf(dest, sizeof(dest), "10.%u.%u.%u", 1 + i % 2, i / 2 >> 8, i / 2 & 0xff);
+        snprintf(gw_ip, sizeof(gw_ip), "2.2.%u.%u", i / 2 >> 8, i / 2 & 0xff);
+        CHECK(rt_add_rt_entry_with_lifetime(&rt, dest, 32, gw_ip, "eth0",
+                    i % 2 ? 1000 + 2 * (i / 2) : 300 + 5 * (i / 2),
+                    rt_pair_flush_on_timer_expiry));
+    }
+
+    alarm(20);
+    while(rt_count(&rt))
+        usleep(100 * 1000);
+    alarm(0);
+
+    rt_free_rt_table(&rt);
+    printf("delete from callback (%s): ok\n",
+           mode == RT_AGING_BUCKETED ? "bucketed" : "per entry");
+}
+
+/* Bulk flush and re-age per oif and per gateway */
+static void
+check_index(RT_AGING_MODE_T mode)
+{
+    rt_init_rt_table(&rt);
+    if(mode == RT_AGING_BUCKETED)
+        CHECK(rt_enable_bucketed_aging(&rt));
+
+    rt_add_routes(&rt, 800, 0);
+
+    /* A gateway filling the whole gw_ip field has no '\0' */
+    CHECK(rt_add_rt_entry_with_lifetime(&rt, "192.168.1.0", 24,
+                                        "123.123.123.123", "eth9", 0,
+                                        rt_entry_delete_on_timer_expiry));
+    CHECK(rt_add_rt_entry_with_lifetime(&rt, "192.168.2.0", 24,
+                                        "123.123.123.1234", "eth9", 0,
+                                        rt_entry_delete_on_timer_expiry));
+
+    CHECK(rt_flush_by_oif(&rt, "eth1") == 200);
+    CHECK(rt_flush_by_oif(&rt, "eth1") == 0);
+    CHECK(rt_flush_by_gw(&rt, "1.1.1.2") == 100);
+    CHECK(rt_count(&rt) == 502);
+    CHECK(rt_flush_by_gw(&rt, "123.123.123.1234") == 1);
+    CHECK(rt_look_up_rt_entry(&rt, "192.168.1.0", 24) != NULL);
+
+    /* eth0 goes down for a while, gw 1.1.1.3 routes are re-learnt */
+    CHECK(rt_reage_by_oif(&rt, "eth0", 1500) == 200);
+    CHECK(rt_reage_by_gw(&rt, "1.1.1.3", 0) == 100);
+    CHECK(rt_reage_by_oif(&rt, "eth7", 0) == 0);
+    CHECK(rt_reage_by_oif(&rt, "eth0", RT_TABLE_MAX_LIFETIME_MSEC + 1) == 0);
+    CHECK(!rt_add_rt_entry_with_lifetime(&rt, "192.168.3.0", 24, "1.1.1.1",
+                                         "eth0", RT_TABLE_MAX_LIFETIME_MSEC + 1,
+                                         rt_entry_delete_on_timer_expiry));
+    CHECK(rt_remaining_msec("10.0.0.0", 32) <= 3000);
+
+    usleep(3500 * 1000);
+    CHECK(rt_count(&rt) == 501 - 200);
+    CHECK(rt_flush_by_oif(&rt, "eth0") == 0);
+    CHECK(rt_flush_by_oif(&rt, "eth9") == 1);
+
+    rt_free_rt_table(&rt);
+    printf("index (%s): ok\n",
+           mode == RT_AGING_BUCKETED ? "bucketed" : "per entry");
+}
+
+static double
+now_msec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Latency of rt_* calls made by the main loop while n routes age out at
+ * once, with and without an expiry rate limit. Only printed, the numbers
+ * depend on the machine. */
+static void
+check_mass_expiry_latency(RT_AGING_MODE_T mode, uint32_t n, uint32_t max_per_tick)
+{
+    static double samples[4096];
+    char dest[16];
+    double start_msec, t0;
+    uint32_t n_samples = 0;
+
+    rt_init_rt_table(&rt);
+    if(mode == RT_AGING_BUCKETED)
+        CHECK(rt_enable_bucketed_aging(&rt));
+    if(max_per_tick)
+        CHECK(rt_set_expiry_rate_limit(&rt, max_per_tick));
+
+    rt_add_routes(&rt, n, 1000);
+
+    /* Covers the expiry of the whole batch, or the first ticks of it */
+    start_msec = now_msec();
+    while(now_msec() - start_msec < 3000 && n_samples < 4096){
+        snprintf(dest, sizeof(dest), "172.16.%u.%u", n_samples >> 8, n_samples & 0xff);
+        t0 = now_msec();
+        CHECK(rt_add_rt_entry_with_lifetime(&rt, dest, 32, "1.1.1.1", "eth0",
+                                            0, rt_entry_delete_on_timer_expiry));
+        samples[n_samples++] = now_msec() - t0;
+        usleep(1000);
+    }
+
+    qsort(samples, n_samples, sizeof(double), cmp_double);
+    printf("mass expiry latency (%s, %u routes, %u per tick): "
+           "p50 %.3f ms, p99 %.3f ms, max %.3f ms, %u routes left\n",
+           mode == RT_AGING_BUCKETED ? "bucketed" : "per entry",
+           n, max_per_tick, samples[n_samples / 2],
+           samples[n_samples * 99 / 100], samples[n_samples - 1],
+           rt_count(&rt) - n_samples);
+
+    rt_free_rt_table(&rt);
+}
+
+/* Warm restart: n routes go through a snapshot into an empty table and age
+ * out on time, restored routes are refreshed to a full lifetime */
+static void
+check_snapshot_restore(RT_AGING_MODE_T mode, uint32_t n)
+{
+    const char *file_name = "rtm_check.snapshot";
+    unsigned long remaining_msec;
+    char head_dest[16];
+    double start_msec, snapshot_msec, restore_msec;
+
+    rt_init_rt_table(&rt);
+    if(mode == RT_AGING_BUCKETED)
+        CHECK(rt_enable_bucketed_aging(&rt));
+
+    rt_add_routes(&rt, n, 20000);
+    CHECK(rt_add_rt_entry_with_lifetime(&rt, "192.168.1.0", 24, "1.1.1.1",
+                                        "eth0", 1500,
+                                        rt_entry_delete_on_timer_expiry));
+    rt_table_lock(&rt);
+    memcpy(head_dest, rt.head->rt_entry_keys.dest, sizeof(head_dest));
+    remaining_msec = rt_entry_get_remaining_time_in_msec(&rt, rt.head->next);
+    rt_table_unlock(&rt);
+
+    start_msec = now_msec();
+    CHECK(rt_snapshot_rt_table(&rt, file_name));
+    snapshot_msec = now_msec() - start_msec;
+    rt_free_rt_table(&rt);
+
+    rt_init_rt_table(&rt);
+    if(mode == RT_AGING_BUCKETED)
+        CHECK(rt_enable_bucketed_aging(&rt));
+    start_msec = now_msec();
+    CHECK(rt_restore_rt_table(&rt, file_name,
+                              rt_entry_delete_on_timer_expiry) == (long)n + 1);
+    restore_msec = now_msec() - start_msec;
+
+    /* Same order, aging resumed where it stopped. Bucketed aging rounds
+     * both the lifetime left and the restored one up to a tick. */
+    rt_table_lock(&rt);
+    CHECK(strncmp(rt.head->rt_entry_keys.dest, head_dest, sizeof(head_dest)) == 0);
+    CHECK(rt_entry_get_remaining_time_in_msec(&rt, rt.head->next) + 2000 >=
+          remaining_msec);
+    CHECK(rt_entry_get_remaining_time_in_msec(&rt, rt.head->next) <=
+          remaining_msec + 2 * RT_AGE_TICK_INTERVAL * 1000);
+    rt_table_unlock(&rt);
+
+    /* Only into an empty table */
+    CHECK(rt_restore_rt_table(&rt, file_name,
+                              rt_entry_delete_on_timer_expiry) == -1);
+
+    CHECK(rt_refresh_rt_entry(&rt, "10.0.0.1", 32));
+    CHECK(rt_remaining_msec("10.0.0.1", 32) > 25000);
+
+    usleep(4500 * 1000);
+    CHECK(rt_look_up_rt_entry(&rt, "192.168.1.0", 24) == NULL);
+    CHECK(rt_count(&rt) == n);
+
+    rt_free_rt_table(&rt);
+    unlink(file_name);
+    printf("snapshot/restore (%s): ok, %u routes, snapshot %.0f ms, restore %.0f ms\n",
+           mode == RT_AGING_BUCKETED ? "bucketed" : "per entry",
+           n + 1, snapshot_msec, restore_msec);
+}
+
+/* argv[1]: no.of routes for the bucketed snapshot/restore, 1M by default */
+int main(int argc, char **argv)
+{
+    uint32_t n_routes = argc > 1 ? strtoul(argv[1], NULL, 0) : 1000000;
+
+    check_aging(RT_AGING_PER_ENTRY_TIMER);
+    check_aging(RT_AGING_BUCKETED);
+    check_kept(RT_AGING_PER_ENTRY_TIMER, 0);
+    check_kept(RT_AGING_PER_ENTRY_TIMER, 10);
+    check_kept(RT_AGING_BUCKETED, 0);
+    check_jitter(RT_AGING_PER_ENTRY_TIMER);
+    check_jitter(RT_AGING_BUCKETED);
+    check_rate_limit(RT_AGING_PER_ENTRY_TIMER);
+    check_rate_limit(RT_AGING_BUCKETED);
+    check_delete_from_callback(RT_AGING_PER_ENTRY_TIMER);
+    check_delete_from_callback(RT_AGING_BUCKETED);
+    check_snapshot_restore(RT_AGING_PER_ENTRY_TIMER, 1000);
+    check_snapshot_restore(RT_AGING_BUCKETED, n_routes);
+    check_index(RT_AGING_PER_ENTRY_TIMER);
+    check_index(RT_AGING_BUCKETED);
+
+    /* RLIMIT_SIGPENDING bounds the no.of posix timers */
+    check_mass_expiry_latency(RT_AGING_PER_ENTRY_TIMER, 10000, 0);
+    check_mass_expiry_latency(RT_AGING_PER_ENTRY_TIMER, 10000, 1000);
+    check_mass_expiry_latency(RT_AGING_BUCKETED, 100000, 0);
+    check_mass_expiry_latency(RT_AGING_BUCKETED, 100000, 10000);
+
+    printf("PASS\n");
+    return 0;
+}
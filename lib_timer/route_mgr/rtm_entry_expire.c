@@ -9,9 +9,17 @@
 
 static rt_table_t rt; /* Glabal variable of routing table */
 
+/* Invoked once the route entry ages out, removes it from the table */
+static void
+rt_entry_delete_on_timer_expiry(Timer_t *timer, void *user_data)
+{
+    rt_entry_free(&rt, (rt_entry_t *)user_data);
+}
+
 int main(int argc, char **argv)
 {
     rt_init_rt_table(&rt); /* Initialize the routing table */
+    rt_enable_bucketed_aging(&rt); /* Age all entries from one periodic timer */
 
     /* Adding entries to routing table */
     rt_add_new_rt_entry(&rt, "100.1.1.1", 32, "10.1.1.1", "eth0", rt_entry_delete_on_timer_expiry);
@@ -0,0 +1,217 @@
+/***************************************************************************************************
+ * Snapshot and restore of the routing table, so that a restarted daemon comes back with all its
+ * routes and their aging resumed where it stopped.
+ *
+ * File layout (host byte order, the snapshot is not meant to move between machines):
+ *      rt_snapshot_hdr_t
+ *      rt_snapshot_rec_t * n_entries   (in table order, head first)
+ ***************************************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "rtm.h"
+
+#define RT_SNAPSHOT_MAGIC       0x534d5452  /* "RTMS" */
+#define RT_SNAPSHOT_VERSION     1
+#define RT_SNAPSHOT_IO_BUF_SIZE (256 * 1024)
+
+typedef struct rt_snapshot_hdr_{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t n_entries;
+} rt_snapshot_hdr_t;
+
+typedef struct rt_snapshot_rec_{
+    char dest[16];
+    char gw_ip[16];
+    char oif[32];
+    uint32_t remaining_msec;    /* Lifetime left when the snapshot was taken */
+    char mask;
+    char pad[3];
+} rt_snapshot_rec_t;
+
+/* Stream the table to file_name. The snapshot is written to a temporary
+ * file and renamed over file_name, so a crash never leaves a torn file. */
+bool rt_snapshot_rt_table(rt_table_t *rt_table, const char *file_name)
+{
+    char tmp_file_name[256];
+    rt_snapshot_hdr_t hdr;
+    rt_snapshot_rec_t rec;
+    rt_entry_t *rt_entry = NULL;
+    unsigned long remaining_msec;
+    FILE *fp;
+
+    if(snprintf(tmp_file_name, sizeof(tmp_file_name), "%s.tmp", file_name) >=
+       (int)sizeof(tmp_file_name))
+        return false;
+
+    fp = fopen(tmp_file_name, "wb");
+    if(!fp){
+        printf("Error: could not open %s for writing\n", tmp_file_name);
+        return false;
+    }
+    setvbuf(fp, NULL, _IOFBF, RT_SNAPSHOT_IO_BUF_SIZE);
+
+    /* Entry count is patched in once the table walk is done */
+    memset(&hdr, 0, sizeof(rt_snapshot_hdr_t));
+    hdr.magic = RT_SNAPSHOT_MAGIC;
+    hdr.version = RT_SNAPSHOT_VERSION;
+    if(fwrite(&hdr, sizeof(rt_snapshot_hdr_t), 1, fp) != 1)
+        goto error;
+
+    rt_table_lock(rt_table);
+    ITERTAE_RT_TABLE_BEGIN(rt_table, rt_entry)
+    {
+        remaining_msec = rt_entry_get_remaining_time_in_msec(rt_table, rt_entry);
+        if(remaining_msec > RT_TABLE_MAX_LIFETIME_MSEC)
+            remaining_msec = RT_TABLE_MAX_LIFETIME_MSEC;
+
+        memset(&rec, 0, sizeof(rt_snapshot_rec_t));
+        memcpy(rec.dest, rt_entry->rt_entry_keys.dest, sizeof(rec.dest));
+        memcpy(rec.gw_ip, rt_entry->gw_ip, sizeof(rec.gw_ip));
+        memcpy(rec.oif, rt_entry->oif, sizeof(rec.oif));
+        rec.mask = rt_entry->rt_entry_keys.mask;
+        rec.remaining_msec = remaining_msec;
+
+        if(fwrite(&rec, sizeof(rt_snapshot_rec_t), 1, fp) != 1){
+            rt_table_unlock(rt_table);
+            goto error;
+        }
+        hdr.n_entries++;
+    } ITERTAE_RT_TABLE_END(rt_table, rt_entry);
+    rt_table_unlock(rt_table);
+
+    /* On disk before the rename, or a power loss may leave it empty */
+    if(fseek(fp, 0, SEEK_SET) != 0 ||
+       fwrite(&hdr, sizeof(rt_snapshot_hdr_t), 1, fp) != 1 ||
+       fflush(fp) != 0 || fsync(fileno(fp)) != 0)
+        goto error;
+
+    if(fclose(fp) != 0){
+        unlink(tmp_file_name);
+        return false;
+    }
+    if(rename(tmp_file_name, file_name) != 0){
+        unlink(tmp_file_name);
+        return false;
+    }
+    return true;
+
+error:
+    printf("Error: failed to write snapshot %s\n", tmp_file_name);
+    fclose(fp);
+    unlink(tmp_file_name);
+    return false;
+}
+
+/* Map the snapshot and bulk insert its entries into an empty table, each one
+ * ageing out after the lifetime it had left. With bucketed aging the sweep
+ * timer is paused for the duration of the load and no timer is armed per
+ * entry. With per entry aging every restored entry still creates and arms
+ * its own posix timer, use bucketed aging for large tables.
+ * Returns the number of restored entries, -1 on error. A non empty table
+ * is left untouched, a load failing halfway is cleared again. */
+long rt_restore_rt_table(rt_table_t *rt_table, const char *file_name,
+                         void (*delete_cbk)(Timer_t*, void *))
+{
+    rt_snapshot_hdr_t *hdr;
+    rt_snapshot_rec_t *rec;
+    struct stat st;
+    void *map;
+    long n_restored = 0;
+    bool non_empty = false;
+    bool bucketed;
+    uint64_t i;
+    int fd;
+
+    fd = open(file_name, O_RDONLY);
+    if(fd < 0)
+        return -1;
+
+    if(fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(rt_snapshot_hdr_t)){
+        close(fd);
+        return -1;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED)
+        return -1;
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    hdr = (rt_snapshot_hdr_t *)map;
+    if(hdr->magic != RT_SNAPSHOT_MAGIC ||
+       hdr->version != RT_SNAPSHOT_VERSION ||
+       hdr->n_entries != ((size_t)st.st_size - sizeof(rt_snapshot_hdr_t)) /
+                         sizeof(rt_snapshot_rec_t) ||
+       ((size_t)st.st_size - sizeof(rt_snapshot_hdr_t)) % sizeof(rt_snapshot_rec_t)){
+        printf("Error: %s is not a valid routing table snapshot\n", file_name);
+        munmap(map, st.st_size);
+        return -1;
+    }
+    rec = (rt_snapshot_rec_t *)(hdr + 1);
+
+    rt_table_lock(rt_table);
+    bucketed = rt_table->aging_mode == RT_AGING_BUCKETED;
+    rt_table_unlock(rt_table);
+
+    /* Stop the sweep and wait for one already running, it needs the lock */
+    if(bucketed){
+        pause_timer(rt_table->age_timer);
+        timer_callback_lock(rt_table->age_timer);
+        timer_callback_unlock(rt_table->age_timer);
+    }
+
+    rt_table_lock(rt_table);
+    if(rt_table->head){
+        printf("Error: routing table must be empty to restore %s\n", file_name);
+        non_empty = true;
+        n_restored = -1;
+        goto unlock;
+    }
+
+    /* Entries are added at the head, walk backwards to keep the table order */
+    for(i = hdr->n_entries; i > 0; i--){
+        rt_snapshot_rec_t *curr = &rec[i - 1];
+        char dest[sizeof(curr->dest) + 1];
+        char gw_ip[sizeof(curr->gw_ip) + 1];
+        char oif[sizeof(curr->oif) + 1];
+
+        memcpy(dest, curr->dest, sizeof(curr->dest));
+        dest[sizeof(curr->dest)] = '\0';
+        memcpy(gw_ip, curr->gw_ip, sizeof(curr->gw_ip));
+        gw_ip[sizeof(curr->gw_ip)] = '\0';
+        memcpy(oif, curr->oif, sizeof(curr->oif));
+        oif[sizeof(curr->oif)] = '\0';
+
+        /* Overdue entries age out on the next tick */
+        if(!rt_add_rt_entry_with_lifetime(rt_table, dest, curr->mask, gw_ip, oif,
+                    curr->remaining_msec ? curr->remaining_msec : 1,
+                    delete_cbk)){
+            printf("Error: failed to restore %s, %ld of %lu routes loaded\n",
+                   file_name, n_restored, (unsigned long)hdr->n_entries);
+            n_restored = -1;
+            break;
+        }
+        n_restored++;
+    }
+
+unlock:
+    rt_table_unlock(rt_table);
+
+    /* Partly restored, the table was empty: clear it, outside the lock as
+     * it deletes route timers */
+    if(n_restored < 0 && !non_empty)
+        rt_clear_rt_table(rt_table);
+
+    if(bucketed)
+        resume_timer(rt_table->age_timer);
+
+    munmap(map, st.st_size);
+    return n_restored;
+}
@@ -58,28 +58,254 @@ unsigned long timespec_to_millisec (struct timespec *ts)
     return milli_sec;
 }
 
+/*
+ * Timer registry.
+ * Expiry threads are handed a handle (slot index + generation) instead of the
+ * Timer_t pointer. An expiry thread which starts after delete_timer() finds a
+ * stale generation and drops the expiration, while one that got in before
+ * holds a reference which keeps the timer memory alive until it returns.
+ */
+#define TIMER_HANDLE_SHIFT      (sizeof(uintptr_t) * 4)
+#define TIMER_HANDLE_INDEX_MASK (((uintptr_t)1 << TIMER_HANDLE_SHIFT) - 1)
+#define TIMER_SLOT_NONE         UINT32_MAX
+#define TIMER_SLOTS_MAX         \
+    (TIMER_HANDLE_SHIFT >= 32 ? UINT32_MAX - 1 : (uint32_t)TIMER_HANDLE_INDEX_MASK)
+
+typedef struct timer_slot_ {
+    Timer_t     *timer;
+    uint32_t    generation;
+    uint32_t    next_free;
+} timer_slot_t;
+
+static pthread_mutex_t timer_registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static timer_slot_t *timer_slots;
+static uint32_t timer_slots_size;
+static uint32_t timer_slots_used;
+static uint32_t timer_free_slot = TIMER_SLOT_NONE;
+
+static bool timer_registry_add(Timer_t *timer)
+{
+    timer_slot_t *slots;
+    uint32_t new_size;
+    uint32_t index;
+
+    pthread_mutex_lock(&timer_registry_lock);
+    if (timer_free_slot != TIMER_SLOT_NONE) {
+        index = timer_free_slot;
+        timer_free_slot = timer_slots[index].next_free;
+    } else {
+        if (timer_slots_used == timer_slots_size) {
+            if (timer_slots_size > TIMER_SLOTS_MAX / 2) {
+                pthread_mutex_unlock(&timer_registry_lock);
+                return false;
+            }
+            new_size = timer_slots_size ? timer_slots_size * 2 : 64;
+            slots = realloc(timer_slots, new_size * sizeof(timer_slot_t));
+            if (!slots) {
+                pthread_mutex_unlock(&timer_registry_lock);
+                return false;
+            }
+            timer_slots = slots;
+            timer_slots_size = new_size;
+        }
+        index = timer_slots_used++;
+        timer_slots[index].generation = 0;
+    }
+
+    timer_slots[index].timer = timer;
+    timer->handle = ((timer_slots[index].generation & TIMER_HANDLE_INDEX_MASK)
+                     << TIMER_HANDLE_SHIFT) | index;
+    pthread_mutex_unlock(&timer_registry_lock);
+    return true;
+}
+
+/* No expiry thread can take a new reference once this returns */
+static void timer_registry_remove(Timer_t *timer)
+{
+    uint32_t index = timer->handle & TIMER_HANDLE_INDEX_MASK;
+
+    pthread_mutex_lock(&timer_registry_lock);
+    timer_slots[index].timer = NULL;
+    timer_slots[index].generation++;
+    timer_slots[index].next_free = timer_free_slot;
+    timer_free_slot = index;
+    pthread_mutex_unlock(&timer_registry_lock);
+}
+
+/* Returns the referenced timer, NULL if it was deleted already */
+static Timer_t* timer_get(uintptr_t handle)
+{
+    uint32_t index = handle & TIMER_HANDLE_INDEX_MASK;
+    Timer_t *timer = NULL;
+
+    pthread_mutex_lock(&timer_registry_lock);
+    if (index < timer_slots_used &&
+        timer_slots[index].timer &&
+        (timer_slots[index].generation & TIMER_HANDLE_INDEX_MASK) ==
+        (handle >> TIMER_HANDLE_SHIFT)) {
+        timer = timer_slots[index].timer;
+        timer->ref_count++;
+    }
+    pthread_mutex_unlock(&timer_registry_lock);
+    return timer;
+}
+
+static void timer_free(Timer_t *timer)
+{
+    pthread_cond_destroy(&timer->cb_done);
+    pthread_mutex_destroy(&timer->cb_lock);
+
+    free(timer->posix_timer);
+    timer->posix_timer = NULL;
+
+    free(timer);
+}
+
+/* Drop a reference, the last one frees the timer */
+static void timer_put(Timer_t *timer)
+{
+    uint32_t ref_count;
+
+    pthread_mutex_lock(&timer_registry_lock);
+    ref_count = --timer->ref_count;
+    pthread_mutex_unlock(&timer_registry_lock);
+
+    if (!ref_count)
+        timer_free(timer);
+}
+
+/*------------------- Helpers, to be called with cb_lock held -------------------*/
+
+static bool timer_in_own_callback(Timer_t *timer)
+{
+    return timer->cb_running &&
+           pthread_equal(timer->cb_thread, pthread_self());
+}
+
+/* Wait for a callback running on another thread to return */
+static void timer_wait_callback(Timer_t *timer)
+{
+    while (timer->cb_running && !timer_in_own_callback(timer))
+        pthread_cond_wait(&timer->cb_done, &timer->cb_lock);
+}
+
+static void timer_cancel(Timer_t *timer)
+{
+    TIMER_STATE_T timer_curr_state;
+    timer_curr_state = timer_get_current_state(timer);
+
+    if(timer_curr_state == TIMER_INIT || timer_curr_state == TIMER_DELETED)
+    {
+        return; /* No operation */
+    }
+
+    /* Only Paused or running timer can be cancelled */
+    timer_fill_itimerspec(&timer->ts.it_value, 0);
+    timer_fill_itimerspec(&timer->ts.it_interval, 0);
+    timer->remaining_time = 0;
+    timer->invocation_counter = 0;
+
+    resurrect_timer(timer);
+    timer_set_state(timer, TIMER_CANCELLED);
+}
+
+static void timer_reschedule(Timer_t *timer,
+                             unsigned long exp_time,
+                             unsigned long sec_exp_time)
+{
+    uint32_t invocation_counter;
+    TIMER_STATE_T timer_state;
+
+    timer_state = timer_get_current_state(timer);
+
+    /* deleted timer can't be reschduled */
+    if(timer_state == TIMER_DELETED)
+        assert(0);
+
+    invocation_counter = timer->invocation_counter;
+    if(timer_state != TIMER_CANCELLED)
+        timer_cancel(timer);
+    timer->invocation_counter = invocation_counter;
+
+    timer_fill_itimerspec(&timer->ts.it_value, exp_time);
+    if(!timer->exp_backoff)
+    {
+        timer_fill_itimerspec(&timer->ts.it_interval, sec_exp_time);
+        timer->exp_backoff_time = 0;
+    }
+    else
+    {
+        timer_fill_itimerspec(&timer->ts.it_interval, 0);
+        timer->exp_backoff_time = exp_time;
+    }
+
+    timer->remaining_time = 0;
+    /* State first, an expiry thread checks it as soon as cb_lock is dropped */
+    timer_set_state(timer, TIMER_RUNNING);
+    resurrect_timer(timer);
+}
+
+/*
+ * Runs on the expiry thread. The callback itself is invoked without cb_lock
+ * held, so it is free to use any timer API on its own timer, including
+ * delete_timer(). A one shot timer is cancelled once it fired (the kernel
+ * disarmed it already), the callback may re-arm it e.g. by restart_timer().
+ */
 static void timer_callback_wrapper(union sigval arg)
 {
-    Timer_t *timer = (Timer_t *)(arg.sival_ptr);
+    Timer_t *timer = timer_get((uintptr_t)(arg.sival_ptr));
+    void *user_arg;
+    bool one_shot;
+
+    if (!timer)
+        return; /* Deleted while this expiration was in flight */
+
+    pthread_mutex_lock(&timer->cb_lock);
+
+    /* Raced with cancel/pause/delete, or the previous callback still runs */
+    if (!is_timer_running(timer) || timer->cb_running)
+        goto done;
+
     timer->invocation_counter++;
 
     if (timer->threshold &&
         (timer->invocation_counter > timer->threshold))
     {
-        cancel_timer(timer);
-        return;
+        timer_cancel(timer);
+        goto done;
     }
 
+    one_shot = !timer->exp_backoff && !timer->sec_exp_timer;
+    if (one_shot)
+        timer_set_state(timer, TIMER_CANCELLED);
+
+    timer->cb_running = true;
+    timer->cb_thread = pthread_self();
+    user_arg = timer->user_arg;
+    pthread_mutex_unlock(&timer->cb_lock);
+
     /* Invoking thfunctional API to do functionality */
-    (timer->timer_cb)(timer, timer->user_arg);
+    (timer->timer_cb)(timer, user_arg);
+
+    pthread_mutex_lock(&timer->cb_lock);
+    timer->cb_running = false;
+    pthread_cond_broadcast(&timer->cb_done);
+
+    /* Callback cancelled, paused or deleted its own timer, don't re-arm it */
+    if (one_shot || !is_timer_running(timer))
+        goto done;
 
     if (timer->exp_backoff) {
         if (timer->exp_backoff_time <= 0)
-          return;
-        reschedule_timer(timer, timer->exp_backoff_time *= 2, 0);
+          goto done;
+        timer_reschedule(timer, timer->exp_backoff_time *= 2, 0);
     } else {
-        reschedule_timer(timer, timer->exp_timer, timer->sec_exp_timer);
+        timer_reschedule(timer, timer->exp_timer, timer->sec_exp_timer);
     }
+
+done:
+    pthread_mutex_unlock(&timer->cb_lock);
+    timer_put(timer);
 }
 
 /* Function:Initialize (construct) the timer data structure.
@@ -111,6 +337,17 @@ Timer_t* initialize_timer (void (*timer_cb)(Timer_t *, void *),
     timer->posix_timer = calloc(1, sizeof(timer_t));
     if (!timer->posix_timer) {
         printf("Error: calloc failed to allocate memory for posix_timer\n");
+        free(timer);
+        return NULL;
+    }
+
+    pthread_mutex_init(&timer->cb_lock, NULL);
+    pthread_cond_init(&timer->cb_done, NULL);
+    timer->ref_count = 1; /* Owner reference, dropped by delete_timer() */
+
+    if (!timer_registry_add(timer)) {
+        printf("Error: failed to register the timer\n");
+        timer_free(timer);
         return NULL;
     }
 
@@ -126,7 +363,7 @@ Timer_t* initialize_timer (void (*timer_cb)(Timer_t *, void *),
 
     /*  */
     memset(&evp, 0, sizeof(struct sigevent));
-    evp.sigev_value.sival_ptr = (void *)(timer);
+    evp.sigev_value.sival_ptr = (void *)(timer->handle);
     evp.sigev_notify = SIGEV_THREAD;
     /* Wrapper API internally invokes the user specified API when timer expires */
     evp.sigev_notify_function = timer_callback_wrapper;
@@ -162,15 +399,18 @@ void resurrect_timer (Timer_t *timer)
 
 void start_timer (Timer_t *timer)
 {
-    resurrect_timer(timer);
+    pthread_mutex_lock(&timer->cb_lock);
     timer_set_state(timer, TIMER_RUNNING);
+    resurrect_timer(timer);
+    pthread_mutex_unlock(&timer->cb_lock);
 }
 
 unsigned long timer_get_remaining_time_in_msec(Timer_t *timer)
 {
     struct itimerspec remaining_time;
-    if (timer->timer_state == TIMER_DELETED ||
-        timer->timer_state == TIMER_CANCELLED) {
+    TIMER_STATE_T timer_state = timer_get_current_state(timer);
+    if (timer_state == TIMER_DELETED ||
+        timer_state == TIMER_CANCELLED) {
         return ~0;
     }
 
@@ -184,8 +424,11 @@ unsigned long timer_get_remaining_time_in_msec(Timer_t *timer)
 
 void pause_timer(Timer_t *timer)
 {
-    if (timer->timer_state == TIMER_PAUSED)
+    pthread_mutex_lock(&timer->cb_lock);
+    if (timer_get_current_state(timer) == TIMER_PAUSED) {
+        pthread_mutex_unlock(&timer->cb_lock);
         return;
+    }
 
     /* get the reamining time of the timer */
     timer->remaining_time = timer_get_remaining_time_in_msec(timer);
@@ -196,12 +439,15 @@ void pause_timer(Timer_t *timer)
 
     resurrect_timer(timer);
     timer_set_state (timer, TIMER_PAUSED);
+    pthread_mutex_unlock(&timer->cb_lock);
 }
 
 void resume_timer(Timer_t *timer)
 {
-    if (timer->timer_state != TIMER_PAUSED)
+    pthread_mutex_lock(&timer->cb_lock);
+    if (timer_get_current_state(timer) != TIMER_PAUSED)
     {
+        pthread_mutex_unlock(&timer->cb_lock);
         printf("Timer is not in TIMER_PAUSED state\n");
         return;
     }
@@ -211,52 +457,78 @@ void resume_timer(Timer_t *timer)
     timer_fill_itimerspec(&timer->ts.it_interval, timer->sec_exp_timer);
     timer->remaining_time = 0; /* reset time_remaining */
 
-    resurrect_timer(timer);
     /* set to TIMER_RESUMED, once expires the remainig_time then state needs to change to RUNNING */
     timer_set_state (timer, TIMER_RESUMED);
+    resurrect_timer(timer);
+    pthread_mutex_unlock(&timer->cb_lock);
 }
 
+/*
+ * Waits for a callback running on another thread to return, once done the
+ * callback is never invoked again. From the timer's own callback it returns
+ * right away, the memory is released when the callback returns.
+ */
 void delete_timer(Timer_t *timer)
 {
     int rc;
-    rc = timer_delete(*(timer->posix_timer));
-    assert(rc >= 0);
+
+    pthread_mutex_lock(&timer->cb_lock);
+    /* No disarm, timer_delete() below does it. Expirations delivered
+     * meanwhile see the state and are dropped. */
+    timer_set_state(timer, TIMER_CANCELLED);
+    timer_wait_callback(timer);
 
     /* User arg need to be freed by Application */
     timer->user_arg = NULL; 
     timer_set_state(timer, TIMER_DELETED);
+    pthread_mutex_unlock(&timer->cb_lock);
 
-    free(timer->posix_timer);
-    timer->posix_timer = NULL;
+    timer_registry_remove(timer);
+    rc = timer_delete(*(timer->posix_timer));
+    assert(rc >= 0);
 
-    free(timer);
-    timer = NULL;
+    timer_put(timer);
 }
 
 void cancel_timer(Timer_t *timer)
 {
-    TIMER_STATE_T timer_curr_state;
-    timer_curr_state = timer_get_current_state(timer);
+    pthread_mutex_lock(&timer->cb_lock);
+    timer_cancel(timer);
+    pthread_mutex_unlock(&timer->cb_lock);
+}
 
-    if(timer_curr_state == TIMER_INIT || timer_curr_state == TIMER_DELETED)
-    {
-        return; /* No operation */
-    }
+/*
+ * Same as cancel_timer(), but also waits for a callback running on another
+ * thread to return.
+ */
+void cancel_timer_sync(Timer_t *timer)
+{
+    pthread_mutex_lock(&timer->cb_lock);
+    timer_cancel(timer);
+    timer_wait_callback(timer);
+    pthread_mutex_unlock(&timer->cb_lock);
+}
 
-    /* Only Paused or running timer can be cancelled */
-    timer_fill_itimerspec(&timer->ts.it_value, 0);
-    timer_fill_itimerspec(&timer->ts.it_interval, 0);
-    timer->remaining_time = 0;
-    timer->invocation_counter = 0;
+/*
+ * Holds off the timer callback, e.g. while the application moves user_arg.
+ * Waits for a callback running on another thread to return.
+ */
+void timer_callback_lock(Timer_t *timer)
+{
+    pthread_mutex_lock(&timer->cb_lock);
+    timer_wait_callback(timer);
+}
 
-    resurrect_timer(timer);
-    timer_set_state(timer, TIMER_CANCELLED);
+void timer_callback_unlock(Timer_t *timer)
+{
+    pthread_mutex_unlock(&timer->cb_lock);
 }
 
 void restart_timer(Timer_t *timer)
 {
-    assert(timer->timer_state != TIMER_DELETED);
-    cancel_timer(timer);
+    pthread_mutex_lock(&timer->cb_lock);
+    assert(timer_get_current_state(timer) != TIMER_DELETED);
+    timer_cancel(timer);
 
     timer_fill_itimerspec(&timer->ts.it_value, timer->exp_timer);
     if(!timer->exp_backoff)
@@ -268,43 +540,33 @@ void restart_timer(Timer_t *timer)
     timer->remaining_time = 0;
     timer->exp_backoff_time = timer->exp_timer;
 
-    resurrect_timer(timer);
     timer_set_state(timer, TIMER_RUNNING);
+    resurrect_timer(timer);
+    pthread_mutex_unlock(&timer->cb_lock);
 }
 
 void reschedule_timer(Timer_t *timer,
                         unsigned long exp_time,
                         unsigned long sec_exp_time)
 {
-    uint32_t invocation_counter;
-    TIMER_STATE_T timer_state;
-
-    timer_state = timer_get_current_state(timer);
-
-    /* deleted timer can't be reschduled */
-    if(timer_state == TIMER_DELETED)
-        assert(0);
-
-    invocation_counter = timer->invocation_counter;
-    if(timer_state != TIMER_CANCELLED)
-        cancel_timer(timer);
-    timer->invocation_counter = invocation_counter;
-
-    timer_fill_itimerspec(&timer->ts.it_value, exp_time);
-    if(!timer->exp_backoff)
-    {
-        timer_fill_itimerspec(&timer->ts.it_interval, sec_exp_time);
-        timer->exp_backoff_time = 0;
-    }
-    else
-    {
-        timer_fill_itimerspec(&timer->ts.it_interval, 0);
-        timer->exp_backoff_time = exp_time;
-    }
+    pthread_mutex_lock(&timer->cb_lock);
+    timer_reschedule(timer, exp_time, sec_exp_time);
+    pthread_mutex_unlock(&timer->cb_lock);
+}
 
-    timer->remaining_time = 0;
-    resurrect_timer(timer);
-    timer_set_state(timer, TIMER_RUNNING);
+/*
+ * Unlike reschedule_timer(), the new intervals are kept for the following
+ * expirations and for restart_timer().
+ */
+void timer_update_intervals(Timer_t *timer,
+                            unsigned long exp_timer,
+                            unsigned long sec_exp_timer)
+{
+    pthread_mutex_lock(&timer->cb_lock);
+    timer->exp_timer = exp_timer;
+    timer->sec_exp_timer = sec_exp_timer;
+    timer_reschedule(timer, exp_timer, sec_exp_timer);
+    pthread_mutex_unlock(&timer->cb_lock);
 }
 
 bool is_timer_running(Timer_t *timer)
@@ -324,7 +586,7 @@ void print_timer(Timer_t *timer)
         printf("Counter = %u, time remaining = %lu, state = %s\n",
                 timer->invocation_counter,
                 timer_get_remaining_time_in_msec(timer),
-                print_timer_state_str(timer->timer_state));
+                print_timer_state_str(timer_get_current_state(timer)));
     }
 }
 
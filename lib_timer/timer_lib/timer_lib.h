@@ -10,6 +10,11 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <pthread.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 typedef enum TIMER_STATE_ {
     TIMER_INIT = 0,
@@ -37,19 +42,28 @@ typedef struct Timer_ {
     struct itimerspec   ts; /* schedule the timer (specify exp & sec_exp time values) */
     unsigned long exp_backoff_time; /* Exponential backoff time interval */
     TIMER_STATE_T   timer_state; /* Current state of timer (ex: running, pause, cancel...etc */
+
+    /* Synchronization with the expiry threads, owned by timer_lib */
+    pthread_mutex_t cb_lock;    /* Protects the timer attributes */
+    pthread_cond_t  cb_done;    /* Signalled when the callback returns */
+    pthread_t   cb_thread;      /* Thread running the callback, if cb_running */
+    bool        cb_running;
+    uint32_t    ref_count;      /* Owner + expiry threads using the timer */
+    uintptr_t   handle;         /* Registry handle passed to expiry threads */
 } Timer_t;
 
 /*------------------------------------Timer Library APIs------------------------------- */
+/* State is written under cb_lock, but may be read without it */
 static inline void 
 timer_set_state(Timer_t *timer, TIMER_STATE_T timer_state)
 {
-    timer->timer_state = timer_state;
+    __atomic_store_n(&timer->timer_state, timer_state, __ATOMIC_RELEASE);
 }
 
 static inline TIMER_STATE_T
 timer_get_current_state(Timer_t *timer)
 {
-    return timer->timer_state;
+    return __atomic_load_n(&timer->timer_state, __ATOMIC_ACQUIRE);
 }
 
 static inline void
@@ -70,12 +84,17 @@ Timer_t* initialize_timer(void (*timer_cb)(Timer_t *, void *),
 void resurrect_timer(Timer_t *timer); /* resurrect means raise from dead */
 void start_timer(Timer_t *timer);
 void cancel_timer(Timer_t *timer);
+void cancel_timer_sync(Timer_t *timer);
 void restart_timer(Timer_t *timer);
 void pause_timer(Timer_t *timer);
+void resume_timer(Timer_t *timer);
 void delete_timer(Timer_t *timer);
 void reschedule_timer(Timer_t *timer, 
                       unsigned long exp_time,
                       unsigned long sec_exp_time);
+void timer_update_intervals(Timer_t *timer,
+                            unsigned long exp_timer,
+                            unsigned long sec_exp_timer);
 void print_timer(Timer_t *timer);
 unsigned long timer_get_remaining_time_in_msec(Timer_t *timer);
 unsigned long timespec_to_millisec(struct timespec *ts);
@@ -83,5 +102,11 @@ void timer_fill_itimerspec(struct timespec *ts,
                            unsigned long msec);
 bool is_timer_running(Timer_t *timer);
 char* print_timer_state_str(TIMER_STATE_T state);
+void timer_callback_lock(Timer_t *timer);
+void timer_callback_unlock(Timer_t *timer);
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif /* _TIMER_LIB_H_ */
@@ -0,0 +1,232 @@
+/*****************************************************************************
+ * Header only C++20 layer over timer_lib.h
+ *
+ * -> timer_lib::Timer, move only owner of a Timer_t. The callable is stored
+ *    inline (no std::function, no heap) and invoked through a per type
+ *    trampoline. The destructor cancels synchronously and deletes the timer.
+ * -> co_await timer_lib::after(duration), resumes the coroutine on the
+ *    timer thread once the duration elapsed. Each co_await allocates a
+ *    Timer_t and creates a kernel timer, use a Timer for hot loops.
+ * ***************************************************************************/
+#ifndef _TIMER_LIB_HPP_
+#define _TIMER_LIB_HPP_
+
+#include <chrono>
+#include <concepts>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include "timer_lib.h"
+
+namespace timer_lib {
+
+template <std::size_t Capacity = 48>
+class basic_timer {
+public:
+    basic_timer() noexcept = default;
+
+    /* fn: invoked as fn() on the timer thread, must fit in Capacity bytes
+     * first: first expiration, interval: subsequent ones, 0 for one shot
+     * threshold: max no.of invocations, 0 for infinite */
+    template <typename F>
+        requires (!std::same_as<std::decay_t<F>, basic_timer> &&
+                  std::invocable<std::decay_t<F> &>)
+    explicit basic_timer(F &&fn,
+                         std::chrono::milliseconds first,
+                         std::chrono::milliseconds interval = {},
+                         uint32_t threshold = 0)
+    {
+        using Fn = std::decay_t<F>;
+        static_assert(sizeof(Fn) <= Capacity,
+                      "callable too large for the inline storage, raise Capacity");
+        static_assert(alignof(Fn) <= alignof(std::max_align_t),
+                      "callable over-aligned for the inline storage");
+        static_assert(std::is_nothrow_move_constructible_v<Fn>,
+                      "callable must be nothrow move constructible");
+
+        ::new (static_cast<void *>(storage_)) Fn(std::forward<F>(fn));
+        ops_ = &ops_for<Fn>;
+
+        timer_ = initialize_timer(&trampoline<Fn>,
+                                  first.count(), interval.count(), threshold,
+                                  this, false);
+        if (!timer_) {
+            ops_->destroy(storage_);
+            ops_ = nullptr;
+            throw std::bad_alloc();
+        }
+    }
+
+    basic_timer(basic_timer &&other) noexcept { take(other); }
+
+    basic_timer &operator=(basic_timer &&other) noexcept
+    {
+        if (this != &other) {
+            reset();
+            take(other);
+        }
+        return *this;
+    }
+
+    basic_timer(const basic_timer &) = delete;
+    basic_timer &operator=(const basic_timer &) = delete;
+
+    ~basic_timer() { reset(); }
+
+    /* Cancel (waiting for a running callback) and release the timer.
+     * Like the destructor and move assignment, must not be called from the
+     * timer's own callback: the callable would be destroyed while it runs. */
+    void reset() noexcept
+    {
+        if (!timer_)
+            return;
+
+        cancel_timer_sync(timer_);
+        delete_timer(timer_);
+        timer_ = nullptr;
+
+        ops_->destroy(storage_);
+        ops_ = nullptr;
+    }
+
+    /* No-ops on an empty (default constructed or moved from) timer */
+
+    /* (Re)arms with the last set intervals, also after cancel() */
+    void start() noexcept { if (timer_) restart_timer(timer_); }
+    void cancel() noexcept { if (timer_) cancel_timer_sync(timer_); }
+    void pause() noexcept { if (timer_) pause_timer(timer_); }
+    void resume() noexcept { if (timer_) resume_timer(timer_); }
+
+    /* The new intervals also apply to later start() calls */
+    void reschedule(std::chrono::milliseconds first,
+                    std::chrono::milliseconds interval = {}) noexcept
+    {
+        if (timer_)
+            timer_update_intervals(timer_, first.count(), interval.count());
+    }
+
+    std::chrono::milliseconds remaining() const noexcept
+    {
+        if (!timer_)
+            return std::chrono::milliseconds(0);
+        return std::chrono::milliseconds(timer_get_remaining_time_in_msec(timer_));
+    }
+
+    bool running() const noexcept { return timer_ && is_timer_running(timer_); }
+    Timer_t *native_handle() const noexcept { return timer_; }
+    explicit operator bool() const noexcept { return timer_ != nullptr; }
+
+private:
+    struct callable_ops {
+        void (*relocate)(void *dst, void *src) noexcept;
+        void (*destroy)(void *obj) noexcept;
+    };
+
+    template <typename Fn>
+    static constexpr callable_ops ops_for = {
+        [](void *dst, void *src) noexcept {
+            Fn *fn = std::launder(static_cast<Fn *>(src));
+            ::new (dst) Fn(std::move(*fn));
+            fn->~Fn();
+        },
+        [](void *obj) noexcept {
+            std::launder(static_cast<Fn *>(obj))->~Fn();
+        },
+    };
+
+    /* Called by timer_lib on the expiry thread, user_arg is the current
+     * owner of the callable. timer_lib does not re-arm one shot timers. */
+    template <typename Fn>
+    static void trampoline(Timer_t *, void *arg)
+    {
+        auto *self = static_cast<basic_timer *>(arg);
+        (*std::launder(reinterpret_cast<Fn *>(self->storage_)))();
+    }
+
+    /* The callable moves along with the handle. Must not be called from
+     * the timer's own callback. */
+    void take(basic_timer &other) noexcept
+    {
+        if (!other.timer_)
+            return;
+
+        Timer_t *timer = other.timer_;
+        timer_callback_lock(timer);
+        other.ops_->relocate(storage_, other.storage_);
+        ops_ = other.ops_;
+        timer_ = timer;
+        timer->user_arg = this;
+        other.ops_ = nullptr;
+        other.timer_ = nullptr;
+        timer_callback_unlock(timer);
+    }
+
+    Timer_t *timer_ = nullptr;
+    const callable_ops *ops_ = nullptr;
+    alignas(std::max_align_t) unsigned char storage_[Capacity];
+};
+
+using Timer = basic_timer<>;
+
+/* Awaitable returned by after(), the coroutine is resumed on the timer thread */
+class sleep_awaiter {
+public:
+    explicit sleep_awaiter(std::chrono::milliseconds delay) noexcept
+        : delay_(delay) {}
+
+    sleep_awaiter(const sleep_awaiter &) = delete;
+    sleep_awaiter &operator=(const sleep_awaiter &) = delete;
+
+    ~sleep_awaiter()
+    {
+        if (timer_) {
+            /* Also fine from on_expiry(), timer_lib defers the delete */
+            cancel_timer_sync(timer_);
+            delete_timer(timer_);
+        }
+    }
+
+    bool await_ready() const noexcept { return delay_.count() <= 0; }
+
+    void await_suspend(std::coroutine_handle<> handle)
+    {
+        handle_ = handle;
+
+        Timer_t *timer = initialize_timer(&on_expiry, delay_.count(), 0, 0,
+                                          this, false);
+        if (!timer)
+            throw std::bad_alloc();
+        timer_ = timer;
+
+        /* The coroutine may be resumed (and this awaiter gone) as soon as
+         * start_timer() drops the timer lock, only the local is used here */
+        start_timer(timer);
+    }
+
+    void await_resume() const noexcept {}
+
+private:
+    static void on_expiry(Timer_t *, void *arg)
+    {
+        auto *self = static_cast<sleep_awaiter *>(arg);
+        self->handle_.resume();
+    }
+
+    std::chrono::milliseconds delay_;
+    std::coroutine_handle<> handle_;
+    Timer_t *timer_ = nullptr;
+};
+
+template <typename Rep, typename Period>
+sleep_awaiter after(std::chrono::duration<Rep, Period> delay) noexcept
+{
+    return sleep_awaiter(std::chrono::ceil<std::chrono::milliseconds>(delay));
+}
+
+} /* namespace timer_lib */
+
+#endif /* _TIMER_LIB_HPP_ */
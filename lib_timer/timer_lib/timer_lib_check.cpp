@@ -0,0 +1,134 @@
+/*****************************************************************************
+ * Non interactive check of timer_lib.hpp, exits non zero on the first failure.
+ * Build: gcc -c timer_lib.c && g++ -std=c++20 -o timer_lib_check timer_lib_check.cpp timer_lib.o -lrt -lpthread
+ * ***************************************************************************/
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <thread>
+#include "timer_lib.hpp"
+
+using namespace std::chrono_literals;
+
+#define CHECK(cond)                                                         \
+    do {                                                                    \
+        if (!(cond)) {                                                      \
+            std::printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond);     \
+            std::exit(1);                                                   \
+        }                                                                   \
+    } while (0)
+
+/* Fire and forget coroutine, enough to drive co_await */
+struct task {
+    struct promise_type {
+        task get_return_object() noexcept { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept { std::terminate(); }
+    };
+};
+
+static void check_periodic_and_move()
+{
+    std::atomic<int> hits{0};
+    int stopped;
+
+    {
+        timer_lib::Timer timer([&hits] { hits++; }, 10ms, 10ms);
+        timer.start();
+        std::this_thread::sleep_for(100ms);
+
+        /* Keeps firing on the new owner */
+        timer_lib::Timer owner(std::move(timer));
+        CHECK(!timer && !timer.running());
+        stopped = hits;
+        std::this_thread::sleep_for(50ms);
+        CHECK(owner.running());
+        CHECK(hits > stopped);
+    }
+
+    /* The destructor waited for a running callback, none comes later */
+    stopped = hits;
+    std::this_thread::sleep_for(50ms);
+    CHECK(hits == stopped);
+    std::printf("periodic and move: ok\n");
+}
+
+static void check_one_shot_and_reschedule()
+{
+    std::atomic<int> hits{0};
+    int fired;
+
+    timer_lib::Timer timer([&hits] { hits++; }, 10ms);
+    timer.start();
+    std::this_thread::sleep_for(100ms);
+    CHECK(hits == 1);
+    timer.start();
+    std::this_thread::sleep_for(100ms);
+    CHECK(hits == 2);
+
+    /* New intervals are kept, a one shot becomes periodic and back */
+    timer.reschedule(10ms, 10ms);
+    std::this_thread::sleep_for(100ms);
+    timer.cancel();
+    fired = hits;
+    CHECK(fired >= 2 + 3);
+    timer.reschedule(10ms);
+    timer.start();
+    std::this_thread::sleep_for(100ms);
+    CHECK(hits == fired + 1);
+
+    timer.reschedule(10s);
+    CHECK(timer.remaining() > 5s);
+    timer.pause();
+    timer.resume();
+    CHECK(timer.remaining() > 5s);
+    std::printf("one shot and reschedule: ok\n");
+}
+
+static void check_empty()
+{
+    timer_lib::Timer timer;
+
+    /* No-ops, nothing to dereference */
+    timer.start();
+    timer.cancel();
+    timer.pause();
+    timer.resume();
+    timer.reschedule(10ms);
+    CHECK(timer.remaining() == 0ms);
+    CHECK(!timer.running() && !timer && !timer.native_handle());
+    std::printf("empty timer: ok\n");
+}
+
+static std::atomic<int> sleepers_done{0};
+
+static task sleeper()
+{
+    for (int i = 0; i < 3; i++)
+        co_await timer_lib::after(20ms);
+    sleepers_done++;
+}
+
+static void check_after()
+{
+    for (int i = 0; i < 100; i++)
+        sleeper();
+    for (int i = 0; i < 100 && sleepers_done < 100; i++)
+        std::this_thread::sleep_for(10ms);
+    CHECK(sleepers_done == 100);
+    std::printf("co_await after: ok\n");
+}
+
+int main()
+{
+    check_periodic_and_move();
+    check_one_shot_and_reschedule();
+    check_empty();
+    check_after();
+
+    std::printf("PASS\n");
+    return 0;
+}
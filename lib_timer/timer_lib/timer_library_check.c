@@ -0,0 +1,169 @@
+/***************************************************************************************************
+ * Non interactive check of timer_lib, exits non zero on the first failure.
+ * Build: gcc -o timer_library_check timer_library_check.c timer_lib.c -lrt -lpthread
+ ***************************************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "timer_lib.h"
+
+#define CHECK(cond)                                                         \
+    do {                                                                    \
+        if(!(cond)){                                                        \
+            printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond);          \
+            exit(1);                                                        \
+        }                                                                   \
+    } while(0)
+
+static uint32_t counter;
+
+static void
+count_cbk(Timer_t *timer, void *user_data)
+{
+    __atomic_add_fetch(&counter, 1, __ATOMIC_SEQ_CST);
+}
+
+static uint32_t
+counter_get(void)
+{
+    return __atomic_load_n(&counter, __ATOMIC_SEQ_CST);
+}
+
+/* Deletes its own timer, as route entries do on expiry */
+static void
+self_delete_cbk(Timer_t *timer, void *user_data)
+{
+    __atomic_add_fetch(&counter, 1, __ATOMIC_SEQ_CST);
+    delete_timer(timer);
+}
+
+static void
+slow_cbk(Timer_t *timer, void *user_data)
+{
+    usleep(20 * 1000);
+    __atomic_add_fetch(&counter, 1, __ATOMIC_SEQ_CST);
+}
+
+static void
+check_self_delete(void)
+{
+    Timer_t *timer;
+    int i;
+
+    counter = 0;
+    for(i = 0; i < 100; i++){
+        timer = initialize_timer(self_delete_cbk, 5, 5, 0, NULL, false);
+        CHECK(timer);
+        start_timer(timer);
+    }
+    usleep(200 * 1000);
+    CHECK(counter_get() == 100);
+    printf("self delete: ok\n");
+}
+
+static void
+check_cancel_sync(void)
+{
+    Timer_t *timer;
+    uint32_t fired;
+
+    counter = 0;
+    timer = initialize_timer(slow_cbk, 1, 1, 0, NULL, false);
+    CHECK(timer);
+    start_timer(timer);
+    usleep(50 * 1000);
+
+    /* The callback running now has completed once cancel_timer_sync returns */
+    cancel_timer_sync(timer);
+    fired = counter_get();
+    CHECK(fired > 0);
+    CHECK(timer_get_current_state(timer) == TIMER_CANCELLED);
+    usleep(50 * 1000);
+    CHECK(counter_get() == fired);
+
+    delete_timer(timer);
+    printf("cancel sync: ok\n");
+}
+
+static void
+check_delete_in_flight(void)
+{
+    Timer_t *timers[64];
+    int i, round;
+
+    /* Expirations are still being delivered when the timers go away */
+    for(round = 0; round < 20; round++){
+        for(i = 0; i < 64; i++){
+            timers[i] = initialize_timer(count_cbk, 1, 1, 0, NULL, false);
+            CHECK(timers[i]);
+            start_timer(timers[i]);
+        }
+        usleep(2 * 1000);
+        for(i = 0; i < 64; i++)
+            delete_timer(timers[i]);
+    }
+    usleep(20 * 1000);
+    printf("delete in flight: ok\n");
+}
+
+static void
+check_update_intervals(void)
+{
+    Timer_t *timer;
+
+    counter = 0;
+    timer = initialize_timer(count_cbk, 10000, 0, 0, NULL, false);
+    CHECK(timer);
+    start_timer(timer);
+    CHECK(timer_get_remaining_time_in_msec(timer) > 5000);
+
+    /* Kept for restart_timer() too */
+    timer_update_intervals(timer, 2000, 0);
+    CHECK(timer->exp_timer == 2000);
+    CHECK(timer_get_remaining_time_in_msec(timer) <= 2000);
+    restart_timer(timer);
+    CHECK(timer_get_remaining_time_in_msec(timer) <= 2000);
+
+    pause_timer(timer);
+    CHECK(timer_get_current_state(timer) == TIMER_PAUSED);
+    resume_timer(timer);
+    CHECK(timer_get_current_state(timer) == TIMER_RESUMED);
+
+    delete_timer(timer);
+    CHECK(counter_get() == 0);
+    printf("update intervals: ok\n");
+}
+
+static void
+check_one_shot(void)
+{
+    Timer_t *timer;
+
+    counter = 0;
+    timer = initialize_timer(count_cbk, 5, 0, 0, NULL, false);
+    CHECK(timer);
+    start_timer(timer);
+    usleep(50 * 1000);
+
+    /* Fired once and was not re-armed, a restart fires it again */
+    CHECK(counter_get() == 1);
+    CHECK(timer_get_current_state(timer) == TIMER_CANCELLED);
+    restart_timer(timer);
+    usleep(50 * 1000);
+    CHECK(counter_get() == 2);
+
+    delete_timer(timer);
+    printf("one shot: ok\n");
+}
+
+int main(int argc, char **argv)
+{
+    check_self_delete();
+    check_cancel_sync();
+    check_delete_in_flight();
+    check_update_intervals();
+    check_one_shot();
+
+    printf("PASS\n");
+    return 0;
+}